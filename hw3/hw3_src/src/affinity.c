@@ -0,0 +1,200 @@
+/*******************************************************************************
+* CPU Placement (implementation)
+*
+* Description:
+*     Pins the threads of the server to a set of CPUs given on the command
+*     line, keeping the workers on the NUMA node of the event loop
+*     whenever possible.
+*
+* Notes:
+*     The node of a CPU is found by looking for the nodeN link in its
+*     sysfs directory (/sys/devices/system/cpu/cpuX/). On machines without
+*     NUMA, or if sysfs is not available, every CPU is on node 0.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "affinity.h"
+
+/* Return the NUMA node of <cpu>, or 0 if it cannot be determined */
+int affinity_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent * entry;
+	DIR * dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL)
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+
+	closedir(dir);
+	return node;
+}
+
+/* Add <cpu> at the end of <placement> */
+static int placement_add(struct cpu_placement * placement, int cpu)
+{
+	int * cpus;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+
+	cpus = (int *)realloc(placement->cpus, (placement->count + 1) * sizeof(int));
+	if (cpus == NULL)
+		return -1;
+
+	placement->cpus = cpus;
+	placement->cpus[placement->count++] = cpu;
+	return 0;
+}
+
+/* Reorder the CPUs so that the ones on the node of the first CPU come
+ * first, followed by the others grouped by node. The order given by
+ * the user is kept within each node. */
+static void placement_sort(struct cpu_placement * placement)
+{
+	int * nodes, i, j, cpu, node, home;
+
+	nodes = (int *)malloc(placement->count * sizeof(int));
+	if (nodes == NULL)
+		return;
+
+	for (i = 0; i < placement->count; ++i)
+		nodes[i] = affinity_cpu_node(placement->cpus[i]);
+	home = nodes[0];
+
+	/* Insertion sort, to keep the order stable. The home node sorts
+	 * before every other node. */
+	for (i = 1; i < placement->count; ++i) {
+		cpu = placement->cpus[i];
+		node = nodes[i];
+
+		for (j = i; j > 0; --j) {
+			if (nodes[j - 1] == home)
+				break;
+			if (node != home && nodes[j - 1] <= node)
+				break;
+			placement->cpus[j] = placement->cpus[j - 1];
+			nodes[j] = nodes[j - 1];
+		}
+		placement->cpus[j] = cpu;
+		nodes[j] = node;
+	}
+
+	free(nodes);
+}
+
+/* Parse a list of CPUs such as "0-3,6" into <placement>, ordered so
+ * that the CPUs on the same NUMA node as the first one come first.
+ * Returns 0 on success and -1 if the list is not valid. */
+int affinity_parse(const char * list, struct cpu_placement * placement)
+{
+	const char * pos = list;
+	char * end;
+	long first, last, cpu;
+
+	placement->count = 0;
+	placement->cpus = NULL;
+
+	while (*pos) {
+		first = strtol(pos, &end, 10);
+		if (end == pos)
+			goto err_free;
+
+		last = first;
+		if (*end == '-') {
+			pos = end + 1;
+			last = strtol(pos, &end, 10);
+			if (end == pos || last < first)
+				goto err_free;
+		}
+
+		for (cpu = first; cpu <= last; ++cpu)
+			if (placement_add(placement, cpu) < 0)
+				goto err_free;
+
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			goto err_free;
+		pos = end;
+	}
+
+	if (placement->count == 0)
+		return -1;
+
+	placement_sort(placement);
+	return 0;
+
+err_free:
+	affinity_free(placement);
+	return -1;
+}
+
+/* Release the memory held by <placement> */
+void affinity_free(struct cpu_placement * placement)
+{
+	free(placement->cpus);
+	placement->cpus = NULL;
+	placement->count = 0;
+}
+
+/* Return the CPU for the event loop thread (slot 0) or for worker
+ * <slot - 1>, or AFFINITY_NONE if no placement was requested. The event
+ * loop has a CPU of its own as long as there are at least two. */
+int affinity_cpu(struct cpu_placement * placement, int slot)
+{
+	if (placement->count == 0)
+		return AFFINITY_NONE;
+
+	if (slot == 0 || placement->count == 1)
+		return placement->cpus[0];
+
+	return placement->cpus[1 + (slot - 1) % (placement->count - 1)];
+}
+
+/* Pin the calling thread to <cpu>. Does nothing for AFFINITY_NONE.
+ * Returns 0 on success and -1 on failure. */
+int affinity_pin_self(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu == AFFINITY_NONE)
+		return 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	/* A pid of 0 means the calling thread, not the whole process */
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Let <thread> run on any of the CPUs of <placement>. Used for helper
+ * threads that have no CPU of their own. Returns 0 on success and -1
+ * on failure. */
+int affinity_pin_thread(pthread_t thread, struct cpu_placement * placement)
+{
+	cpu_set_t set;
+	int i;
+
+	if (placement->count == 0)
+		return 0;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < placement->count; ++i)
+		CPU_SET(placement->cpus[i], &set);
+
+	return (pthread_setaffinity_np(thread, sizeof(set), &set) == 0 ? 0 : -1);
+}
@@ -0,0 +1,61 @@
+/*******************************************************************************
+* CPU Placement (header)
+*
+* Description:
+*     Pins the threads of the server to a set of CPUs given on the command
+*     line. The first CPU of the set goes to the thread running the event
+*     loop, and the workers are spread over the others, so that the
+*     scheduler can no longer migrate a busy-waiting worker, or put it on
+*     the same core as the event loop.
+*
+* Notes:
+*     Placement is NUMA-aware: the CPUs are reordered so that the ones on
+*     the node of the event loop come first, and workers only spill over
+*     to other nodes once the local CPUs are taken. The NUMA topology is
+*     read from sysfs, so no external library is needed. Memory is placed
+*     by the kernel on the node of the thread that first touches it, so
+*     the event loop thread is pinned before it allocates the queue.
+*
+*******************************************************************************/
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <pthread.h>
+
+/* No CPU assigned: the thread is not pinned */
+#define AFFINITY_NONE (-1)
+
+/* Set of CPUs the threads of the server are placed on, in placement
+ * order */
+struct cpu_placement {
+	int count;
+	int * cpus;
+};
+
+/* Parse a list of CPUs such as "0-3,6" into <placement>, ordered so
+ * that the CPUs on the same NUMA node as the first one come first.
+ * Returns 0 on success and -1 if the list is not valid. */
+int affinity_parse(const char * list, struct cpu_placement * placement);
+
+/* Release the memory held by <placement> */
+void affinity_free(struct cpu_placement * placement);
+
+/* Return the CPU for the event loop thread (slot 0) or for worker
+ * <slot - 1>, or AFFINITY_NONE if no placement was requested. The event
+ * loop has a CPU of its own as long as there are at least two. */
+int affinity_cpu(struct cpu_placement * placement, int slot);
+
+/* Return the NUMA node of <cpu>, or 0 if it cannot be determined */
+int affinity_cpu_node(int cpu);
+
+/* Pin the calling thread to <cpu>. Does nothing for AFFINITY_NONE.
+ * Returns 0 on success and -1 on failure. */
+int affinity_pin_self(int cpu);
+
+/* Let <thread> run on any of the CPUs of <placement>. Used for helper
+ * threads that have no CPU of their own. Returns 0 on success and -1
+ * on failure. */
+int affinity_pin_thread(pthread_t thread, struct cpu_placement * placement);
+
+#endif
@@ -2,6 +2,9 @@
 
 */
 
+#ifndef __COMMON_H__
+#define __COMMON_H__
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -51,3 +54,4 @@ struct response {
 	uint8_t  ack;
 };
 
+#endif
@@ -0,0 +1,635 @@
+/*******************************************************************************
+* Client Connection Handling (implementation)
+*
+* Description:
+*     Event loop that accepts any number of client connections on the
+*     listening socket and receives requests from all of them without
+*     blocking, using epoll. Each request remembers the connection it came
+*     from, so that the response can be sent back on the right socket.
+*
+* Notes:
+*     All the sockets are non-blocking. Each connection has a receive
+*     buffer: one recv() may bring in several requests, all of which are
+*     parsed out, and the trailing bytes of an incomplete request are kept
+*     until the rest of it arrives. Bytes that a socket does not take right
+*     away are buffered on the connection, which is then also watched for
+*     EPOLLOUT; the event loop sends them once the socket is writable, and
+*     drops the client if the buffer overflows.
+*
+*     The first bytes sent by a client tell whether it starts with a
+*     hello of the compact protocol or with a raw request. In the compact
+*     protocol, a batch of responses goes out as a single frame.
+*
+*     With batching enabled, a connection with unsent responses is linked
+*     into a global pending list. Idle workers drain the whole list, and
+*     the event loop wakes up periodically to send out batches that have
+*     waited longer than the configured delay.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include "conn.h"
+#include "queue.h"
+#include "proto.h"
+
+/* Response batching parameters, see conn_init() */
+static size_t tx_batch = 1;
+static long tx_delay_us = CONN_TX_DEFAULT_DELAY;
+
+/* List of connections with batched responses not sent yet */
+static sem_t tx_pending_lock;
+static struct connection * tx_pending_head;
+
+/* The epoll instance of the event loop, which workers also update to
+ * have their unsent bytes sent out */
+static int conn_epoll_fd = -1;
+
+/* Configure response batching: send responses in batches of up to
+ * <batch> responses, none of which waits more than <delay_us>
+ * microseconds. A batch of 1 sends every response right away. Must be
+ * called before conn_event_loop(). */
+int conn_init(size_t batch, long delay_us)
+{
+	if (batch < 1)
+		batch = 1;
+	if (batch > CONN_TX_MAX)
+		batch = CONN_TX_MAX;
+
+	tx_batch = batch;
+	tx_delay_us = delay_us;
+	tx_pending_head = NULL;
+
+	return sem_init(&tx_pending_lock, 0, 1);
+}
+
+/* Allocate the state of a newly accepted connection */
+static struct connection * conn_create(int fd)
+{
+	struct connection * conn;
+
+	conn = (struct connection *)malloc(sizeof(struct connection));
+	if (conn == NULL)
+		return NULL;
+
+	conn->fd = fd;
+	atomic_init(&conn->refs, 1);
+	conn->proto = PROTO_UNKNOWN;
+	conn->rx_len = 0;
+	conn->tx_len = 0;
+	conn->tx_pending = 0;
+	conn->tx_next = NULL;
+	conn->out_len = 0;
+	conn->dead = 0;
+
+	if (sem_init(&conn->send_lock, 0, 1) < 0) {
+		free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/* Take an additional reference to a connection */
+void conn_get(struct connection * conn)
+{
+	atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+}
+
+/* Drop a reference to a connection, closing it on the last one */
+void conn_put(struct connection * conn)
+{
+	if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	shutdown(conn->fd, SHUT_RDWR);
+	close(conn->fd);
+	sem_destroy(&conn->send_lock);
+	free(conn);
+}
+
+/* Watch the connection for incoming requests and, if <out> is set,
+ * for the socket becoming writable */
+static void conn_watch_out(struct connection * conn, int out)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+
+	/* Fails harmlessly if the event loop already let go of the
+	 * connection, or is gone altogether */
+	epoll_ctl(conn_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* Send up to <len> bytes from <buf> without blocking. Returns the
+ * number of bytes sent, or -1 if the client is gone. */
+static ssize_t conn_send_some(struct connection * conn, const void * buf, size_t len)
+{
+	ssize_t out_bytes;
+	size_t sent = 0;
+
+	while (sent < len) {
+		out_bytes = send(conn->fd, (const char *)buf + sent, len - sent,
+				 MSG_NOSIGNAL);
+
+		if (out_bytes > 0)
+			sent += out_bytes;
+		else if (out_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else if (out_bytes < 0 && errno == EINTR)
+			continue;
+		else
+			return -1;
+	}
+
+	return sent;
+}
+
+/* Drop a client that is gone or does not read its responses. The
+ * event loop then sees the socket shut down and lets go of it. Must be
+ * called with send_lock held. */
+static int conn_drop(struct connection * conn)
+{
+	conn->dead = 1;
+	conn->out_len = 0;
+	shutdown(conn->fd, SHUT_RDWR);
+	return -1;
+}
+
+/* Send as many of the buffered bytes of the connection as the socket
+ * takes, and stop watching for EPOLLOUT once they are all out. Must be
+ * called with send_lock held. Returns 0 on success and -1 if the client
+ * is gone. */
+static int conn_send_out(struct connection * conn)
+{
+	ssize_t sent;
+
+	if (conn->out_len == 0)
+		return 0;
+
+	sent = conn_send_some(conn, conn->out_buf, conn->out_len);
+	if (sent < 0)
+		return conn_drop(conn);
+
+	conn->out_len -= sent;
+	if (conn->out_len > 0 && sent > 0)
+		memmove(conn->out_buf, conn->out_buf + sent, conn->out_len);
+	if (conn->out_len == 0)
+		conn_watch_out(conn, 0);
+
+	return 0;
+}
+
+/* Write <len> bytes from <buf> to the connection without blocking.
+ * What the socket does not take is buffered, after any bytes already
+ * waiting, and sent out by the event loop. Must be called with
+ * send_lock held. Returns 0 on success and -1 if the client is gone. */
+static int conn_write_all(struct connection * conn, const void * buf, size_t len)
+{
+	ssize_t sent;
+
+	if (conn->dead)
+		return -1;
+
+	/* Bytes already waiting must go out first */
+	if (conn_send_out(conn) < 0)
+		return -1;
+
+	if (conn->out_len == 0) {
+		sent = conn_send_some(conn, buf, len);
+		if (sent < 0)
+			return conn_drop(conn);
+		buf = (const char *)buf + sent;
+		len -= sent;
+	}
+
+	if (len == 0)
+		return 0;
+
+	/* The client is not reading: keep the rest for later, unless it
+	 * has already let too much pile up */
+	if (len > CONN_OUT_SIZE - conn->out_len)
+		return conn_drop(conn);
+
+	if (conn->out_len == 0)
+		conn_watch_out(conn, 1);
+	memcpy(conn->out_buf + conn->out_len, buf, len);
+	conn->out_len += len;
+
+	return 0;
+}
+
+/* Write <count> responses to the connection, as raw structs or as
+ * frames depending on the protocol of the client. Must be called with
+ * send_lock held. Returns 0 on success and -1 if the client is gone. */
+static int conn_write_responses(struct connection * conn, struct response * resps,
+				size_t count)
+{
+	uint8_t frame[PROTO_MAX_RESP_FRAME];
+	size_t len, encoded;
+
+	if (conn->proto <= PROTO_LEGACY)
+		return conn_write_all(conn, resps, count * sizeof(struct response));
+
+	while (count > 0) {
+		len = proto_encode_responses(frame, resps, count, &encoded);
+		if (conn_write_all(conn, frame, len) < 0)
+			return -1;
+		resps += encoded;
+		count -= encoded;
+	}
+
+	return 0;
+}
+
+/* Send out the responses batched on the connection with a single
+ * system call. Must be called with send_lock held. */
+static int conn_flush_locked(struct connection * conn)
+{
+	int retval;
+
+	if (conn->tx_len == 0)
+		return 0;
+
+	retval = conn_write_responses(conn, conn->tx_buf, conn->tx_len);
+	conn->tx_len = 0;
+	return retval;
+}
+
+/* Return how long the oldest batched response of the connection has
+ * been waiting at <now>, in microseconds. Must be called with
+ * send_lock held. */
+static long conn_tx_age(struct connection * conn, nstime_t now)
+{
+	return (now - conn->tx_oldest_ns) / 1000;
+}
+
+/* Send a response back on the connection, or add it to the current
+ * batch. Returns 0 on success and -1 if the client is gone. */
+int conn_send_response(struct connection * conn, struct response * resp)
+{
+	nstime_t now;
+	int retval = 0;
+
+	sem_wait(&conn->send_lock);
+
+	if (tx_batch <= 1) {
+		retval = conn_write_responses(conn, resp, 1);
+		goto out;
+	}
+
+	now = now_ns();
+	if (conn->tx_len == 0)
+		conn->tx_oldest_ns = now;
+	conn->tx_buf[conn->tx_len++] = *resp;
+
+	/* Send the batch out if it is full or old enough */
+	if (conn->tx_len >= tx_batch || conn_tx_age(conn, now) >= tx_delay_us) {
+		retval = conn_flush_locked(conn);
+		goto out;
+	}
+
+	/* Otherwise make sure that someone will send it out later */
+	if (!conn->tx_pending) {
+		conn->tx_pending = 1;
+		conn_get(conn);
+
+		sem_wait(&tx_pending_lock);
+		conn->tx_next = tx_pending_head;
+		tx_pending_head = conn;
+		sem_post(&tx_pending_lock);
+	}
+
+out:
+	sem_post(&conn->send_lock);
+	return retval;
+}
+
+/* Go through the list of connections with batched responses and send
+ * them out. If <stale_only> is set, only batches older than the
+ * configured delay are sent, and the other connections stay on the
+ * list. */
+static void conn_flush_list(int stale_only)
+{
+	struct connection * conn, * next, * keep = NULL;
+	nstime_t now;
+
+	sem_wait(&tx_pending_lock);
+	conn = tx_pending_head;
+	tx_pending_head = NULL;
+	sem_post(&tx_pending_lock);
+
+	if (conn == NULL)
+		return;
+
+	now = now_ns();
+
+	for (; conn != NULL; conn = next) {
+		next = conn->tx_next;
+
+		sem_wait(&conn->send_lock);
+		if (stale_only && conn->tx_len > 0 && conn_tx_age(conn, now) < tx_delay_us) {
+			conn->tx_next = keep;
+			keep = conn;
+			sem_post(&conn->send_lock);
+			continue;
+		}
+
+		conn_flush_locked(conn);
+		conn->tx_pending = 0;
+		sem_post(&conn->send_lock);
+
+		/* Drop the reference held by the list */
+		conn_put(conn);
+	}
+
+	/* Put back the connections whose batch can still wait */
+	while (keep != NULL) {
+		next = keep->tx_next;
+
+		sem_wait(&tx_pending_lock);
+		keep->tx_next = tx_pending_head;
+		tx_pending_head = keep;
+		sem_post(&tx_pending_lock);
+
+		keep = next;
+	}
+}
+
+/* Send out the batched responses of every connection. Meant to be
+ * called by a worker before it goes idle. */
+void conn_flush_pending(void)
+{
+	if (tx_batch > 1)
+		conn_flush_list(0);
+}
+
+/* Decide which protocol the client speaks from its first bytes, and
+ * answer its hello if it sent one. Returns the number of bytes of the
+ * receive buffer consumed, or -1 if the client is gone. */
+static int conn_handshake(struct connection * conn)
+{
+	uint8_t hello[PROTO_HELLO_SIZE];
+	int version, retval;
+
+	version = proto_read_hello((uint8_t *)conn->rx_buf);
+	if (version < 0) {
+		conn->proto = PROTO_LEGACY;
+		return 0;
+	}
+
+	/* Settle on the highest version that both sides speak */
+	conn->proto = (version < PROTO_VERSION ? version : PROTO_VERSION);
+	proto_write_hello(hello, conn->proto);
+
+	sem_wait(&conn->send_lock);
+	retval = conn_write_all(conn, hello, sizeof(hello));
+	sem_post(&conn->send_lock);
+
+	return (retval < 0 ? -1 : PROTO_HELLO_SIZE);
+}
+
+/* Pass one request received on the connection to the handler */
+static void conn_deliver(struct connection * conn, struct proto_request * wire,
+			 nstime_t receipt_ns, request_handler_t handler, void * arg)
+{
+	struct request_meta req;
+
+	memset(&req, 0, sizeof(req));
+	req.req_id = wire->req_id;
+	req.sent_ns = wire->sent_ns;
+	req.length_ns = wire->length_ns;
+	req.receipt_ns = receipt_ns;
+
+	conn_get(conn);
+	req.conn = conn;
+	handler(&req, arg);
+}
+
+/* Pass every complete request in the receive buffer to the handler,
+ * and move the bytes of a trailing incomplete request (or frame) to
+ * the front of the buffer. Returns the number of requests handled, or
+ * -1 if the client must be dropped. */
+static int conn_parse(struct connection * conn, nstime_t receipt_ns,
+		      request_handler_t handler, void * arg)
+{
+	struct proto_request reqs[PROTO_MAX_BATCH];
+	struct request legacy;
+	size_t offset = 0, nr_reqs, i;
+	ssize_t size;
+	int count = 0, res;
+
+	/* A hello is shorter than a raw request, so wait for it */
+	if (conn->proto == PROTO_UNKNOWN) {
+		if (conn->rx_len < PROTO_HELLO_SIZE)
+			return 0;
+		res = conn_handshake(conn);
+		if (res < 0)
+			return -1;
+		offset = res;
+	}
+
+	while (conn->proto == PROTO_LEGACY
+	       && conn->rx_len - offset >= sizeof(struct request)) {
+		memcpy(&legacy, conn->rx_buf + offset, sizeof(struct request));
+		offset += sizeof(struct request);
+
+		reqs[0].req_id = legacy.req_id;
+		reqs[0].sent_ns = timespec_to_ns(&legacy.req_timestamp);
+		reqs[0].length_ns = timespec_to_ns(&legacy.req_length);
+		conn_deliver(conn, &reqs[0], receipt_ns, handler, arg);
+		count++;
+	}
+
+	while (conn->proto > PROTO_LEGACY) {
+		size = proto_frame_size((uint8_t *)conn->rx_buf + offset,
+					conn->rx_len - offset, PROTO_FRAME_REQUESTS);
+		if (size < 0)
+			return -1;
+		if (size == 0 || (size_t)size > conn->rx_len - offset)
+			break;
+
+		nr_reqs = proto_decode_requests((uint8_t *)conn->rx_buf + offset, reqs);
+		offset += size;
+
+		for (i = 0; i < nr_reqs; ++i)
+			conn_deliver(conn, &reqs[i], receipt_ns, handler, arg);
+		count += nr_reqs;
+	}
+
+	conn->rx_len -= offset;
+	if (conn->rx_len > 0 && offset > 0)
+		memmove(conn->rx_buf, conn->rx_buf + offset, conn->rx_len);
+
+	return count;
+}
+
+/* Receive as many requests as are available on the connection, up to
+ * about CONN_MAX_BURST, and pass them to the handler. Returns 1 if the
+ * connection is still open, 0 if the client disconnected and -1 on
+ * error. */
+static int conn_receive(struct connection * conn, request_handler_t handler, void * arg)
+{
+	nstime_t receipt_ns;
+	ssize_t in_bytes;
+	int count = 0, res;
+
+	while (count < CONN_MAX_BURST) {
+		in_bytes = recv(conn->fd, conn->rx_buf + conn->rx_len,
+				CONN_RX_SIZE - conn->rx_len, 0);
+
+		if (in_bytes == 0)
+			return 0;
+
+		if (in_bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* All the requests in this chunk arrived together */
+		receipt_ns = now_ns();
+		conn->rx_len += in_bytes;
+		res = conn_parse(conn, receipt_ns, handler, arg);
+		if (res < 0)
+			return -1;
+		count += res;
+	}
+
+	return 1;
+}
+
+/* Accept all the pending connections on the listening socket and add
+ * them to the epoll set. Returns the number of accepted connections. */
+static int conn_accept_all(int epoll_fd, int listen_sock)
+{
+	struct epoll_event ev;
+	struct connection * conn;
+	int fd, accepted = 0;
+
+	while ((fd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		conn = conn_create(fd);
+		if (conn == NULL) {
+			ERROR_INFO();
+			perror("Unable to allocate connection");
+			close(fd);
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			ERROR_INFO();
+			perror("Unable to watch connection");
+			conn_put(conn);
+			continue;
+		}
+
+		printf("INFO: Client connected. Socket = %d\n", fd);
+		accepted++;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		ERROR_INFO();
+		perror("Unable to accept connections");
+	}
+
+	return accepted;
+}
+
+/* Accept connections on <listen_sock> and pass every request received
+ * to <handler>. Returns once at least one client has connected and all
+ * the clients have disconnected, or -1 on error. */
+int conn_event_loop(int listen_sock, request_handler_t handler, void * arg)
+{
+	struct epoll_event ev, events[EPOLL_MAX_EVENTS];
+	struct connection * conn;
+	int epoll_fd, n, i, res, timeout = -1;
+	int active = 0, connected = 0, retval = 0;
+
+	/* The listening socket must not block in accept() */
+	fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK);
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		ERROR_INFO();
+		perror("Unable to create epoll instance");
+		return -1;
+	}
+
+	/* The listening socket is the only one with a NULL pointer */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+		ERROR_INFO();
+		perror("Unable to watch listening socket");
+		close(epoll_fd);
+		return -1;
+	}
+	conn_epoll_fd = epoll_fd;
+
+	/* With batching on, wake up regularly to send out batches that
+	 * have waited too long */
+	if (tx_batch > 1)
+		timeout = (tx_delay_us > 1000 ? (tx_delay_us + 999) / 1000 : 1);
+
+	printf("INFO: Waiting for incoming connections...\n");
+
+	/* Keep going until the last client is gone */
+	while (!connected || active > 0) {
+		n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR_INFO();
+			perror("Unable to wait for events");
+			retval = -1;
+			break;
+		}
+
+		if (tx_batch > 1)
+			conn_flush_list(1);
+
+		for (i = 0; i < n; ++i) {
+			conn = (struct connection *)events[i].data.ptr;
+
+			if (conn == NULL) {
+				res = conn_accept_all(epoll_fd, listen_sock);
+				active += res;
+				connected |= (res > 0);
+				continue;
+			}
+
+			/* Send out what the client was not reading before */
+			if (events[i].events & EPOLLOUT) {
+				sem_wait(&conn->send_lock);
+				conn_send_out(conn);
+				sem_post(&conn->send_lock);
+			}
+
+			if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				continue;
+
+			res = conn_receive(conn, handler, arg);
+			if (res > 0)
+				continue;
+
+			/* Stop listening to this client. Queued requests
+			 * still hold a reference to the connection. */
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+			printf("INFO: Client disconnected. Socket = %d\n", conn->fd);
+			conn_put(conn);
+			active--;
+		}
+	}
+
+	conn_epoll_fd = -1;
+	close(epoll_fd);
+	return retval;
+}
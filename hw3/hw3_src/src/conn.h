@@ -0,0 +1,127 @@
+/*******************************************************************************
+* Client Connection Handling (header)
+*
+* Description:
+*     Event loop that accepts any number of client connections on the
+*     listening socket and receives requests from all of them without
+*     blocking, using epoll. Each request remembers the connection it came
+*     from, so that the response can be sent back on the right socket.
+*
+* Notes:
+*     Connections are reference counted: the event loop holds one reference
+*     while the client is connected, and every request that is queued or
+*     being processed holds another. The socket is only closed once the
+*     last reference is dropped, so that a worker never sends a response on
+*     a file descriptor that has been reused by a newer connection.
+*
+*     Clients may speak the compact protocol (see proto.h) or send raw
+*     structs; each connection answers in the protocol its client chose.
+*
+*     Sending never blocks: bytes that the socket does not take right away
+*     are kept with the connection and sent by the event loop once the
+*     client reads again, so that a slow client holds up no one else.
+*
+*     Responses can optionally be batched: they are collected in a
+*     per-connection buffer and sent together once enough of them are
+*     pending, once the oldest has waited long enough, or once a worker
+*     runs out of work and calls conn_flush_pending().
+*
+*******************************************************************************/
+
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "common.h"
+
+/* Maximum number of events handled per call to epoll_wait() */
+#define EPOLL_MAX_EVENTS 64
+
+/* Maximum number of requests received from one connection before
+ * moving on to the next ready connection */
+#define CONN_MAX_BURST 64
+
+/* Size of the per-connection receive buffer. One recv() can bring in
+ * this many bytes, i.e. several requests at once. It also holds a whole
+ * frame of the compact protocol (PROTO_MAX_REQ_FRAME). */
+#define CONN_RX_SIZE (CONN_MAX_BURST * sizeof(struct request))
+
+/* Size of the per-connection buffer of bytes that the socket did not
+ * take yet. A client that lets more than this pile up is dropped. */
+#define CONN_OUT_SIZE (64 * 1024)
+
+/* Maximum number of responses collected before sending them out */
+#define CONN_TX_MAX 64
+
+/* Default maximum time a batched response may wait, in microseconds */
+#define CONN_TX_DEFAULT_DELAY 1000
+
+struct request_meta;
+
+/* State of one client connection */
+struct connection {
+	int fd;
+	atomic_int refs;
+
+	/* Version of the protocol spoken by the client, PROTO_UNKNOWN
+	 * until its first bytes are received */
+	int proto;
+
+	/* Serializes the responses sent by different workers, and
+	 * protects the batch of responses not sent yet */
+	sem_t send_lock;
+	struct response tx_buf[CONN_TX_MAX];
+	size_t tx_len;
+	nstime_t tx_oldest_ns;
+
+	/* Bytes the socket did not take yet, sent by the event loop once
+	 * the socket becomes writable, and whether the client was dropped
+	 * for not reading them. Protected by send_lock. */
+	char out_buf[CONN_OUT_SIZE];
+	size_t out_len;
+	int dead;
+
+	/* Set while the connection is on the list of connections with
+	 * pending responses; the list holds a reference to it. */
+	int tx_pending;
+	struct connection * tx_next;
+
+	/* Bytes received from the client that have not been parsed
+	 * into requests yet. Only the event loop touches these. */
+	char rx_buf[CONN_RX_SIZE];
+	size_t rx_len;
+};
+
+/* Callback invoked by the event loop for every complete request. The
+ * request holds a reference to its connection, which must be released
+ * with conn_put() once the request has been answered. */
+typedef void (*request_handler_t)(struct request_meta * req, void * arg);
+
+/* Configure response batching: send responses in batches of up to
+ * <batch> responses, none of which waits more than <delay_us>
+ * microseconds. A batch of 1 sends every response right away. Must be
+ * called before conn_event_loop(). */
+int conn_init(size_t batch, long delay_us);
+
+/* Take an additional reference to a connection */
+void conn_get(struct connection * conn);
+
+/* Drop a reference to a connection, closing it on the last one */
+void conn_put(struct connection * conn);
+
+/* Send a response back on the connection, or add it to the current
+ * batch. Returns 0 on success and -1 if the client is gone. */
+int conn_send_response(struct connection * conn, struct response * resp);
+
+/* Send out the batched responses of every connection. Meant to be
+ * called by a worker before it goes idle. */
+void conn_flush_pending(void);
+
+/* Accept connections on <listen_sock> and pass every request received
+ * to <handler>. Returns once at least one client has connected and all
+ * the clients have disconnected, or -1 on error. */
+int conn_event_loop(int listen_sock, request_handler_t handler, void * arg);
+
+#endif
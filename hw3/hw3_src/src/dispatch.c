@@ -0,0 +1,353 @@
+/*******************************************************************************
+* Request Dispatcher (implementation)
+*
+* Description:
+*     Distributes the incoming requests over the workers of server_multi,
+*     either through a single shared queue or through per-worker queues
+*     with work stealing.
+*
+* Notes:
+*     With per-worker queues, every request posts the notify semaphore of
+*     its queue first and the global one second. A worker holding a unit
+*     of the global semaphore is thus guaranteed that some queue holds a
+*     request nobody has claimed yet, although it may have to look at all
+*     the queues more than once to find it while other workers are also
+*     taking requests. Units posted by dispatch_wakeup() have no request
+*     behind them, which the worker can tell from the stopping flag.
+*
+*     With private queues, the global semaphore is not used: each worker
+*     waits on the semaphore of its own queue, as in shared mode.
+*
+*******************************************************************************/
+
+#include <strings.h>
+
+#include "dispatch.h"
+
+/* Names of the dispatch policies, as accepted on the command line */
+static const char * policy_names[] = {
+	[DISPATCH_SHARED] = "shared",
+	[DISPATCH_RR] = "RR",
+	[DISPATCH_JSQ] = "JSQ",
+	[DISPATCH_P2C] = "P2C",
+};
+
+/* Create a dispatcher for <workers> workers, admitting up to <limit>
+ * pending requests, served in the order given by <policy> within each
+ * queue. Returns NULL on failure. */
+struct dispatcher * dispatch_create(enum dispatch_policy policy, size_t limit,
+				    int workers, enum queue_policy queue_policy)
+{
+	struct dispatcher * disp;
+	int i;
+
+	if (limit == 0 || workers <= 0)
+		return NULL;
+
+	disp = (struct dispatcher *)aligned_alloc(CACHE_LINE_SIZE,
+						      CACHE_LINE_ROUND(sizeof(struct dispatcher)));
+	if (disp == NULL)
+		return NULL;
+
+	memset(disp, 0, sizeof(struct dispatcher));
+	disp->policy = policy;
+	disp->limit = limit;
+	disp->nr_queues = (policy == DISPATCH_SHARED ? 1 : workers);
+	atomic_init(&disp->pending, 0);
+	atomic_init(&disp->peak, 0);
+	atomic_init(&disp->next, 0);
+	atomic_init(&disp->stopping, 0);
+	disp->by_work = 0;
+	disp->steal = 1;
+	/* Fixed seed, so that runs can be reproduced */
+	disp->rng = 0x9E3779B97F4A7C15ULL;
+	queue_spin_init(&disp->spin, 0);
+
+	if (sem_init(&disp->notify, 0, 0) < 0)
+		goto err_free_disp;
+
+	disp->queues = (struct queue **)calloc(disp->nr_queues, sizeof(struct queue *));
+	if (disp->queues == NULL)
+		goto err_destroy_sem;
+
+	/* Every queue can hold up to the global limit, so that a request
+	 * admitted by the dispatcher is never rejected for lack of room
+	 * in the queue it is placed on */
+	for (i = 0; i < disp->nr_queues; ++i) {
+		disp->queues[i] = queue_create(limit, queue_policy);
+		if (disp->queues[i] == NULL)
+			goto err_free_queues;
+		queue_set_edf(disp->queues[i], EDF_DEFAULT_SLACK,
+			      (policy == DISPATCH_SHARED ? workers : 1));
+	}
+
+	return disp;
+
+err_free_queues:
+	while (--i >= 0)
+		queue_destroy(disp->queues[i]);
+	free(disp->queues);
+err_destroy_sem:
+	sem_destroy(&disp->notify);
+err_free_disp:
+	free(disp);
+	return NULL;
+}
+
+/* Release all the memory held by the dispatcher and its queues */
+void dispatch_destroy(struct dispatcher * disp)
+{
+	int i;
+
+	for (i = 0; i < disp->nr_queues; ++i)
+		queue_destroy(disp->queues[i]);
+
+	sem_destroy(&disp->notify);
+	free(disp->queues);
+	free(disp);
+}
+
+/* Translate a dispatch policy name (e.g. "RR", "JSQ") into a dispatch
+ * policy. Returns -1 if the name is not recognized. */
+int dispatch_parse_policy(const char * name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); ++i)
+		if (strcasecmp(name, policy_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Return the name of a dispatch policy */
+const char * dispatch_policy_name(enum dispatch_policy policy)
+{
+	return policy_names[policy];
+}
+
+/* Configure EDF admission (see queue_set_edf()) on all the queues */
+void dispatch_set_edf(struct dispatcher * disp, double slack)
+{
+	int i;
+
+	for (i = 0; i < disp->nr_queues; ++i)
+		queue_set_edf(disp->queues[i], slack, disp->queues[i]->consumers);
+}
+
+/* Configure how long idle workers spin before sleeping (see
+ * queue_set_spin()). Workers stealing from each other wait on the
+ * global semaphore, the others on the one of their queue. */
+void dispatch_set_spin(struct dispatcher * disp, long spin_ns)
+{
+	int i;
+
+	queue_spin_init(&disp->spin, spin_ns);
+	for (i = 0; i < disp->nr_queues; ++i)
+		queue_set_spin(disp->queues[i], spin_ns);
+}
+
+/* Compare queues by the total length of their requests (if <by_work>
+ * is nonzero) rather than by their number of requests */
+void dispatch_set_weight(struct dispatcher * disp, int by_work)
+{
+	disp->by_work = by_work;
+}
+
+/* Let idle workers steal from their siblings (the default), or keep
+ * every queue private to its worker (if <steal> is zero). Must be
+ * called before the workers are started. */
+void dispatch_set_steal(struct dispatcher * disp, int steal)
+{
+	disp->steal = steal;
+}
+
+/* Return the load of a queue, as used to compare queues */
+static inline uint64_t dispatch_load(struct dispatcher * disp, struct queue * the_queue)
+{
+	return (disp->by_work ? queue_work(the_queue) : queue_length(the_queue));
+}
+
+/* Return the next number of the xorshift64* sequence */
+static inline uint64_t dispatch_random(struct dispatcher * disp)
+{
+	disp->rng ^= disp->rng >> 12;
+	disp->rng ^= disp->rng << 25;
+	disp->rng ^= disp->rng >> 27;
+	return disp->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Pick the queue a new request goes to */
+static int dispatch_pick(struct dispatcher * disp)
+{
+	uint64_t load, best_load;
+	int i, q, best, start;
+
+	if (disp->policy == DISPATCH_P2C) {
+		if (disp->nr_queues == 1)
+			return 0;
+
+		/* Two distinct queues, the shorter of which wins */
+		best = dispatch_random(disp) % disp->nr_queues;
+		q = (best + 1 + dispatch_random(disp) % (disp->nr_queues - 1))
+			% disp->nr_queues;
+		if (dispatch_load(disp, disp->queues[q]) < dispatch_load(disp, disp->queues[best]))
+			best = q;
+		return best;
+	}
+
+	start = atomic_fetch_add_explicit(&disp->next, 1, memory_order_relaxed)
+		% disp->nr_queues;
+
+	if (disp->policy == DISPATCH_RR)
+		return start;
+
+	/* Join the shortest queue. Start looking from the round-robin
+	 * position, so that ties do not always go to the first worker. */
+	best = start;
+	best_load = dispatch_load(disp, disp->queues[start]);
+	for (i = 1; i < disp->nr_queues && best_load > 0; ++i) {
+		q = (start + i) % disp->nr_queues;
+		load = dispatch_load(disp, disp->queues[q]);
+		if (load < best_load) {
+			best = q;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+/* Place a new request on one of the queues. Returns 0 on success, 1 if
+ * too many requests are pending, and 2 if (under EDF) the request can
+ * no longer meet its deadline. */
+int dispatch_add(struct dispatcher * disp, struct request_meta to_add)
+{
+	size_t pending, peak;
+	int retval;
+
+	if (disp->policy == DISPATCH_SHARED)
+		return add_to_queue(to_add, disp->queues[0]);
+
+	/* Global admission: reserve a place among the pending requests */
+	pending = atomic_fetch_add_explicit(&disp->pending, 1, memory_order_relaxed) + 1;
+	if (pending > disp->limit) {
+		atomic_fetch_sub_explicit(&disp->pending, 1, memory_order_relaxed);
+		return 1;
+	}
+
+	peak = atomic_load_explicit(&disp->peak, memory_order_relaxed);
+	while (pending > peak
+	       && !atomic_compare_exchange_weak_explicit(&disp->peak, &peak, pending,
+							 memory_order_relaxed,
+							 memory_order_relaxed))
+		;
+
+	queue_spin_note_arrival(&disp->spin, &to_add);
+
+	retval = add_to_queue(to_add, disp->queues[dispatch_pick(disp)]);
+	if (retval != 0) {
+		atomic_fetch_sub_explicit(&disp->pending, 1, memory_order_relaxed);
+		return retval;
+	}
+
+	if (disp->steal)
+		sem_post(&disp->notify);
+	return 0;
+}
+
+/* Get the next request for worker <worker>: from its own queue if
+ * possible, otherwise stolen from a sibling (unless the queues are
+ * private), in which case *stolen is set. Blocks until a request is
+ * available or until dispatch_wakeup() is called, in which case a
+ * zeroed request is returned. */
+struct request_meta dispatch_get(struct dispatcher * disp, int worker, int * stolen)
+{
+	struct request_meta retval;
+	int i;
+
+	*stolen = 0;
+
+	if (disp->policy == DISPATCH_SHARED)
+		return get_from_queue(disp->queues[0]);
+
+	if (!disp->steal) {
+		retval = get_from_queue(disp->queues[worker]);
+
+		/* An empty request means a wakeup, not a pending one */
+		if (retval.conn != NULL)
+			atomic_fetch_sub_explicit(&disp->pending, 1, memory_order_relaxed);
+		return retval;
+	}
+
+	queue_spin_wait(&disp->spin, &disp->notify);
+
+	for (;;) {
+		if (queue_try_get(disp->queues[worker], &retval) == 0)
+			break;
+
+		/* Our queue is empty: look at the siblings, starting from
+		 * the next one so that thieves spread out */
+		for (i = 1; i < disp->nr_queues; ++i)
+			if (queue_try_get(disp->queues[(worker + i) % disp->nr_queues],
+					  &retval) == 0)
+				break;
+
+		if (i < disp->nr_queues) {
+			*stolen = 1;
+			break;
+		}
+
+		/* Nothing anywhere: either we were woken up to terminate,
+		 * or another worker took the request we were meant to find
+		 * and ours is in a queue we already looked at. */
+		if (atomic_load_explicit(&disp->stopping, memory_order_acquire)) {
+			memset(&retval, 0, sizeof(retval));
+			return retval;
+		}
+		cpu_relax();
+	}
+
+	atomic_fetch_sub_explicit(&disp->pending, 1, memory_order_relaxed);
+	return retval;
+}
+
+/* Wake up <count> workers blocked in dispatch_get() */
+void dispatch_wakeup(struct dispatcher * disp, int count)
+{
+	int i;
+
+	if (disp->policy == DISPATCH_SHARED) {
+		queue_wakeup(disp->queues[0], count);
+		return;
+	}
+
+	if (!disp->steal) {
+		for (i = 0; i < count && i < disp->nr_queues; ++i)
+			queue_wakeup(disp->queues[i], 1);
+		return;
+	}
+
+	atomic_store_explicit(&disp->stopping, 1, memory_order_release);
+	while (count-- > 0)
+		sem_post(&disp->notify);
+}
+
+/* Return the number of requests pending in all the queues */
+size_t dispatch_pending(struct dispatcher * disp)
+{
+	if (disp->policy == DISPATCH_SHARED)
+		return queue_length(disp->queues[0]);
+
+	return atomic_load_explicit(&disp->pending, memory_order_relaxed);
+}
+
+/* Return the highest number of requests that were ever pending at the
+ * same time */
+size_t dispatch_peak(struct dispatcher * disp)
+{
+	if (disp->policy == DISPATCH_SHARED)
+		return queue_peak(disp->queues[0]);
+
+	return atomic_load_explicit(&disp->peak, memory_order_relaxed);
+}
@@ -0,0 +1,134 @@
+/*******************************************************************************
+* Request Dispatcher (header)
+*
+* Description:
+*     Distributes the incoming requests over the workers of server_multi.
+*     In shared mode, all the workers serve a single queue, as before. In
+*     the other modes every worker has a queue of its own: the event loop
+*     places each request on one of them (round-robin, on the shortest
+*     one, or on the shorter of two picked at random), and a worker that
+*     runs out of work steals requests from the queues of its siblings,
+*     unless the queues are private.
+*
+*     Queues are compared by their number of requests or, if weighted, by
+*     the total length of the requests they hold.
+*
+* Notes:
+*     A global limit on the number of pending requests takes the place of
+*     the size of the single queue, so that requests are rejected in the
+*     same conditions whatever the dispatch mode. Idle workers sleep on a
+*     single semaphore counting the pending requests in all the queues,
+*     so that any of them can be woken up to steal.
+*
+*     The queues only support removal from their head, so a thief takes
+*     the request that its owner would have served next, i.e. the oldest
+*     one under FIFO, rather than the newest.
+*
+*******************************************************************************/
+
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "queue.h"
+
+/* How requests are placed on the queues of the workers */
+enum dispatch_policy {
+	DISPATCH_SHARED = 0,	/* One queue shared by all the workers */
+	DISPATCH_RR,		/* Round-robin over per-worker queues */
+	DISPATCH_JSQ,		/* Shortest per-worker queue */
+	DISPATCH_P2C,		/* Shorter of two random per-worker queues */
+};
+
+struct dispatcher {
+	enum dispatch_policy policy;
+
+	/* One queue per worker, or a single one in shared mode */
+	struct queue ** queues;
+	int nr_queues;
+
+	/* Maximum number of pending requests over all the queues, the
+	 * current number and the highest it has been */
+	size_t limit;
+	atomic_size_t pending __attribute__((aligned(CACHE_LINE_SIZE)));
+	atomic_size_t peak;
+
+	/* Next queue for round-robin placement */
+	atomic_uint next;
+
+	/* Compare queues by queued work rather than by length, and let
+	 * idle workers take requests from the queues of their siblings */
+	int by_work;
+	int steal;
+
+	/* State of the random generator used by P2C. Only touched by
+	 * dispatch_add(), i.e. by the event loop. */
+	uint64_t rng;
+
+	/* Set by dispatch_wakeup(), so that workers can tell a wakeup from
+	 * a request taken by a sibling */
+	atomic_int stopping;
+
+	/* Counts the pending requests that workers have yet to pick up,
+	 * over all the queues. Unused in shared mode. */
+	sem_t notify __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct queue_spin spin;
+};
+
+/* Create a dispatcher for <workers> workers, admitting up to <limit>
+ * pending requests, served in the order given by <policy> within each
+ * queue. Returns NULL on failure. */
+struct dispatcher * dispatch_create(enum dispatch_policy policy, size_t limit,
+				    int workers, enum queue_policy queue_policy);
+
+/* Release all the memory held by the dispatcher and its queues */
+void dispatch_destroy(struct dispatcher * disp);
+
+/* Translate a dispatch policy name (e.g. "RR", "JSQ") into a dispatch
+ * policy. Returns -1 if the name is not recognized. */
+int dispatch_parse_policy(const char * name);
+
+/* Return the name of a dispatch policy */
+const char * dispatch_policy_name(enum dispatch_policy policy);
+
+/* Configure EDF admission (see queue_set_edf()) on all the queues */
+void dispatch_set_edf(struct dispatcher * disp, double slack);
+
+/* Configure how long idle workers spin before sleeping (see
+ * queue_set_spin()) */
+void dispatch_set_spin(struct dispatcher * disp, long spin_ns);
+
+/* Compare queues by the total length of their requests (if <by_work>
+ * is nonzero) rather than by their number of requests */
+void dispatch_set_weight(struct dispatcher * disp, int by_work);
+
+/* Let idle workers steal from their siblings (the default), or keep
+ * every queue private to its worker (if <steal> is zero). Must be
+ * called before the workers are started. */
+void dispatch_set_steal(struct dispatcher * disp, int steal);
+
+/* Place a new request on one of the queues. Returns 0 on success, 1 if
+ * too many requests are pending, and 2 if (under EDF) the request can
+ * no longer meet its deadline. Must only be called by one thread. */
+int dispatch_add(struct dispatcher * disp, struct request_meta to_add);
+
+/* Get the next request for worker <worker>: from its own queue if
+ * possible, otherwise stolen from a sibling (unless the queues are
+ * private), in which case *stolen is set. Blocks until a request is
+ * available or until dispatch_wakeup() is called, in which case a
+ * zeroed request is returned. */
+struct request_meta dispatch_get(struct dispatcher * disp, int worker, int * stolen);
+
+/* Wake up <count> workers blocked in dispatch_get() */
+void dispatch_wakeup(struct dispatcher * disp, int count);
+
+/* Return the number of requests pending in all the queues */
+size_t dispatch_pending(struct dispatcher * disp);
+
+/* Return the highest number of requests that were ever pending at the
+ * same time */
+size_t dispatch_peak(struct dispatcher * disp);
+
+#endif
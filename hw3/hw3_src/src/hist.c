@@ -0,0 +1,261 @@
+/*******************************************************************************
+* Latency Histograms (implementation)
+*
+* Description:
+*     Log-bucketed histograms of the response time, queueing delay and
+*     service time of the completed requests, and the reporter thread
+*     that merges and prints them.
+*
+* Notes:
+*     The reporter is started with pthread_create() directly, like the
+*     logger: it does its own stdio and keeps a regular pthreads stack.
+*
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+
+/* Return the bucket a value falls in */
+static inline size_t hist_bucket(uint64_t value)
+{
+	int shift;
+
+	if (value < 2 * HIST_SUB_COUNT)
+		return value;
+
+	shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS;
+	if (shift + HIST_SUB_BITS >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	return (size_t)shift * HIST_SUB_COUNT + (value >> shift);
+}
+
+/* Return the highest value that falls in a bucket */
+static inline uint64_t hist_bucket_max(size_t bucket)
+{
+	int shift;
+
+	if (bucket < 2 * HIST_SUB_COUNT)
+		return bucket;
+
+	shift = bucket / HIST_SUB_COUNT - 1;
+	return ((bucket - shift * HIST_SUB_COUNT + 1) << shift) - 1;
+}
+
+/* Clear a histogram */
+void hist_init(struct hist * hist)
+{
+	size_t i;
+
+	atomic_init(&hist->count, 0);
+	atomic_init(&hist->sum_ns, 0);
+	atomic_init(&hist->max_ns, 0);
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		atomic_init(&hist->buckets[i], 0);
+}
+
+/* Increment a counter that has a single writer */
+#define HIST_ADD(counter, value)					\
+	atomic_store_explicit(&(counter),				\
+			      atomic_load_explicit(&(counter), memory_order_relaxed) \
+			      + (value), memory_order_relaxed)
+
+/* Record a value of <value_ns> nanoseconds. Must only be called by
+ * the single writer of the histogram. */
+void hist_record(struct hist * hist, uint64_t value_ns)
+{
+	HIST_ADD(hist->buckets[hist_bucket(value_ns)], 1);
+	HIST_ADD(hist->sum_ns, value_ns);
+	HIST_ADD(hist->count, 1);
+
+	if (value_ns > atomic_load_explicit(&hist->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&hist->max_ns, value_ns, memory_order_relaxed);
+}
+
+/* Add the contents of <src> to <dst> */
+void hist_merge(struct hist * dst, struct hist * src)
+{
+	uint64_t max_ns;
+	size_t i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		HIST_ADD(dst->buckets[i],
+			 atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+	HIST_ADD(dst->sum_ns, atomic_load_explicit(&src->sum_ns, memory_order_relaxed));
+	HIST_ADD(dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+
+	max_ns = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+	if (max_ns > atomic_load_explicit(&dst->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&dst->max_ns, max_ns, memory_order_relaxed);
+}
+
+/* Return the value below which <percentile> percent of the recorded
+ * values lie, in nanoseconds (0 if the histogram is empty) */
+uint64_t hist_percentile(struct hist * hist, double percentile)
+{
+	uint64_t total = 0, seen = 0, target, max_ns;
+	size_t i;
+
+	/* Count from the buckets themselves, which may be slightly ahead
+	 * of the count field if the writer is active */
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		total += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+	if (total == 0)
+		return 0;
+
+	target = (uint64_t)(percentile / 100 * total + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > total)
+		target = total;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if (seen >= target)
+			break;
+	}
+
+	/* Never report more than was actually seen */
+	max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+	return (hist_bucket_max(i) < max_ns ? hist_bucket_max(i) : max_ns);
+}
+
+/* Clear the histograms of a worker */
+void latency_init(struct latency_hists * lat)
+{
+	hist_init(&lat->response);
+	hist_init(&lat->queueing);
+	hist_init(&lat->service);
+}
+
+/* Set <dst> to the merged histograms of the <nr_srcs> workers in the
+ * array <srcs> */
+void latency_merge(struct latency_hists * dst, struct latency_hists * srcs, int nr_srcs)
+{
+	int i;
+
+	latency_init(dst);
+	for (i = 0; i < nr_srcs; ++i) {
+		hist_merge(&dst->response, &srcs[i].response);
+		hist_merge(&dst->queueing, &srcs[i].queueing);
+		hist_merge(&dst->service, &srcs[i].service);
+	}
+}
+
+/* Return b - a, or 0 if b is earlier than a */
+static inline uint64_t latency_diff(nstime_t a, nstime_t b)
+{
+	return (b > a ? b - a : 0);
+}
+
+/* Record the response time, queueing delay and service time of the
+ * completed request <req>. Must only be called by the owner of
+ * <lat>. */
+void latency_record(struct latency_hists * lat, struct request_meta * req)
+{
+	hist_record(&lat->response,
+		    latency_diff(req->sent_ns, req->completion_ns));
+	hist_record(&lat->queueing, latency_diff(req->receipt_ns, req->start_ns));
+	hist_record(&lat->service, latency_diff(req->start_ns, req->completion_ns));
+}
+
+/* Print the count, mean, p50/p90/p99/p99.9 and maximum of one
+ * histogram on one line, in seconds, as <name> tagged with <label> */
+void fprint_hist(FILE * out, const char * label, const char * name,
+			struct hist * hist)
+{
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	uint64_t sum_ns = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+
+	fprintf(out, "INFO: [%s] %s: count %lu mean %lf p50 %lf p90 %lf "
+		"p99 %lf p99.9 %lf max %lf\n", label, name, count,
+		(count > 0 ? (double)sum_ns / count / NANO_IN_SEC : 0),
+		(double)hist_percentile(hist, 50) / NANO_IN_SEC,
+		(double)hist_percentile(hist, 90) / NANO_IN_SEC,
+		(double)hist_percentile(hist, 99) / NANO_IN_SEC,
+		(double)hist_percentile(hist, 99.9) / NANO_IN_SEC,
+		(double)atomic_load_explicit(&hist->max_ns, memory_order_relaxed)
+		/ NANO_IN_SEC);
+}
+
+/* Print the count, mean, p50/p90/p99/p99.9 and maximum of each of the
+ * histograms in <lat>, in seconds, one line each, tagged with
+ * <label> */
+void fprint_latency(FILE * out, const char * label, struct latency_hists * lat)
+{
+	fprint_hist(out, label, "Response time", &lat->response);
+	fprint_hist(out, label, "Queueing delay", &lat->queueing);
+	fprint_hist(out, label, "Service time", &lat->service);
+	fflush(out);
+}
+
+/* Main logic of the reporter thread: print the merged histograms every
+ * interval until asked to stop */
+static void * reporter_main(void * arg)
+{
+	struct hist_reporter * reporter = (struct hist_reporter *)arg;
+	struct timespec poll = {0, HIST_POLL_MS * 1000 * 1000};
+	nstime_t now, last = now_ns();
+
+	while (!atomic_load_explicit(&reporter->done, memory_order_acquire)) {
+		nanosleep(&poll, NULL);
+
+		if (reporter->interval <= 0)
+			continue;
+
+		now = now_ns();
+		if ((double)(now - last) / NANO_IN_SEC < reporter->interval)
+			continue;
+
+		last = now;
+		latency_merge(&reporter->merged, reporter->sources, reporter->nr_sources);
+		fprint_latency(reporter->out, "periodic", &reporter->merged);
+	}
+
+	return NULL;
+}
+
+/* Start a thread printing to <out>, every <interval> seconds (never
+ * if not positive), the merged histograms of the <nr_sources> workers
+ * in the array <sources>. Returns NULL on failure. */
+struct hist_reporter * hist_reporter_create(FILE * out, double interval,
+					    struct latency_hists * sources,
+					    int nr_sources)
+{
+	struct hist_reporter * reporter;
+
+	reporter = (struct hist_reporter *)
+		aligned_alloc(CACHE_LINE_SIZE,
+			      CACHE_LINE_ROUND(sizeof(struct hist_reporter)));
+	if (reporter == NULL)
+		return NULL;
+
+	reporter->out = out;
+	reporter->interval = interval;
+	reporter->sources = sources;
+	reporter->nr_sources = nr_sources;
+	atomic_init(&reporter->done, 0);
+
+	if (pthread_create(&reporter->thread, NULL, reporter_main, reporter) != 0) {
+		free(reporter);
+		return NULL;
+	}
+
+	return reporter;
+}
+
+/* Stop the reporter thread, print the final merged histograms and
+ * release its memory */
+void hist_reporter_destroy(struct hist_reporter * reporter)
+{
+	atomic_store_explicit(&reporter->done, 1, memory_order_release);
+	pthread_join(reporter->thread, NULL);
+
+	latency_merge(&reporter->merged, reporter->sources, reporter->nr_sources);
+	fprint_latency(reporter->out, "final", &reporter->merged);
+
+	free(reporter);
+}
@@ -0,0 +1,122 @@
+/*******************************************************************************
+* Latency Histograms (header)
+*
+* Description:
+*     Log-bucketed histograms of the response time, queueing delay and
+*     service time of the completed requests, kept by the servers while
+*     they run. Every worker records into histograms of its own, and a
+*     reporter thread merges them on demand to print percentiles, every
+*     few seconds and once more at shutdown.
+*
+* Notes:
+*     The buckets follow the HDR histogram layout: values below twice the
+*     number of sub-buckets get a bucket each, and every further power of
+*     two is split into HIST_SUB_COUNT buckets of equal width. Percentiles
+*     are thus exact to within 1 / HIST_SUB_COUNT (about 3%).
+*
+*     A histogram has a single writer, its worker, which updates the
+*     counters with plain atomic loads and stores instead of locked
+*     read-modify-write operations. Readers may see a histogram in the
+*     middle of an update, i.e. off by the request being recorded.
+*
+*******************************************************************************/
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "queue.h"
+
+/* Each power of two is split into 2^HIST_SUB_BITS buckets */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+/* Values are recorded in nanoseconds, up to 2^HIST_MAX_BITS (about 18
+ * minutes); longer ones go in the last bucket */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/* How often the reporter thread checks whether it must stop, in
+ * milliseconds */
+#define HIST_POLL_MS 10
+
+struct hist {
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum_ns;
+	_Atomic uint64_t max_ns;
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+/* The histograms kept by every worker */
+struct latency_hists {
+	struct hist response;	/* completion - sent */
+	struct hist queueing;	/* start - receipt */
+	struct hist service;	/* completion - start */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Thread printing the merged histograms of all the workers */
+struct hist_reporter {
+	FILE * out;
+	double interval;
+
+	struct latency_hists * sources;
+	int nr_sources;
+
+	/* Scratch space the sources are merged into */
+	struct latency_hists merged;
+
+	atomic_int done;
+	pthread_t thread;
+};
+
+/* Clear a histogram */
+void hist_init(struct hist * hist);
+
+/* Record a value of <value_ns> nanoseconds. Must only be called by
+ * the single writer of the histogram. */
+void hist_record(struct hist * hist, uint64_t value_ns);
+
+/* Add the contents of <src> to <dst> */
+void hist_merge(struct hist * dst, struct hist * src);
+
+/* Return the value below which <percentile> percent of the recorded
+ * values lie, in nanoseconds (0 if the histogram is empty) */
+uint64_t hist_percentile(struct hist * hist, double percentile);
+
+/* Print the count, mean, p50/p90/p99/p99.9 and maximum of one
+ * histogram on one line, in seconds, as <name> tagged with <label> */
+void fprint_hist(FILE * out, const char * label, const char * name, struct hist * hist);
+
+/* Clear the histograms of a worker */
+void latency_init(struct latency_hists * lat);
+
+/* Set <dst> to the merged histograms of the <nr_srcs> workers in the
+ * array <srcs> */
+void latency_merge(struct latency_hists * dst, struct latency_hists * srcs, int nr_srcs);
+
+/* Record the response time, queueing delay and service time of the
+ * completed request <req>. Must only be called by the owner of
+ * <lat>. */
+void latency_record(struct latency_hists * lat, struct request_meta * req);
+
+/* Print the count, mean, p50/p90/p99/p99.9 and maximum of each of the
+ * histograms in <lat>, in seconds, one line each, tagged with
+ * <label> */
+void fprint_latency(FILE * out, const char * label, struct latency_hists * lat);
+
+/* Start a thread printing to <out>, every <interval> seconds (never
+ * if not positive), the merged histograms of the <nr_sources> workers
+ * in the array <sources>. Returns NULL on failure. */
+struct hist_reporter * hist_reporter_create(FILE * out, double interval,
+					    struct latency_hists * sources,
+					    int nr_sources);
+
+/* Stop the reporter thread, print the final merged histograms and
+ * release its memory */
+void hist_reporter_destroy(struct hist_reporter * reporter);
+
+#endif
@@ -0,0 +1,768 @@
+/*******************************************************************************
+* Open-Loop Load Generator
+*
+* Description:
+*     Sends requests to a server at the times given by an arrival
+*     distribution, whether or not the previous ones have been answered,
+*     and collects the responses on a separate thread. Once all the
+*     requests are answered (or the server stops answering), it prints the
+*     offered and achieved rates and a summary of the response times.
+*
+* Usage:
+*     <build directory>/loadgen [-a <arrival rate>] [-s <service rate>] [-n <nr. of requests>] [-d <arrival dist>] [-e <service dist>] [-r <trace file>] [-c <connections>] [-b <batch>] [-P <protocol>] [-h <address>] [-R <seed>] [-v] <port number>
+*
+* Parameters:
+*     port number   - The port number of the server
+*     arrival rate  - Mean number of requests sent per second (default
+*                     1000)
+*     service rate  - Inverse of the mean request length, in requests
+*                     per second (default 2000)
+*     nr. of req.   - Number of requests to send (default 1000, or the
+*                     length of the trace when replaying one)
+*     arrival dist  - Distribution of the inter-arrival times: exp
+*                     (default, i.e. Poisson arrivals), uniform, bimodal,
+*                     pareto, fixed or trace
+*     service dist  - Distribution of the request lengths, same choices
+*                     (default exp)
+*     trace file    - Binary trace written by a server with -l binary,
+*                     whose send times and lengths the trace distribution
+*                     replays
+*     connections   - Number of connections the requests are spread over,
+*                     round-robin (default 1)
+*     batch         - Maximum number of requests that are due at the same
+*                     time sent together (default 64)
+*     protocol      - 1 (default) for the compact protocol, 0 for raw
+*                     structs like the client
+*     address       - IPv4 address of the server (default 127.0.0.1)
+*     seed          - Seed of the random generator (default: time based,
+*                     printed so that a run can be repeated)
+*     -v            - Print one line per request
+*
+* Notes:
+*     The whole schedule is drawn before the first request is sent, so
+*     the sender only has to wait for the next due time and write to a
+*     socket. Requests that are late (because the sender fell behind, or
+*     because several are due at once) are sent together, and the lag of
+*     every send behind its schedule is reported: a large lag means that
+*     the generator itself, not the server, was the bottleneck.
+*
+*     Bimodal values are 0.5 times the mean with probability 0.9 and 5.5
+*     times the mean otherwise. Pareto values have shape 1.5, i.e. a
+*     finite mean and an infinite variance. With the compact protocol,
+*     lengths are capped at about 4.29 seconds.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+#include "proto.h"
+#include "trace.h"
+#include "hist.h"
+
+#define USAGE_STRING							\
+	"Missing or invalid parameter. Exiting.\n"			\
+	"Usage: %s [-a <arrival rate>] [-s <service rate>] [-n <nr. of requests>] " \
+	"[-d <arrival dist>] [-e <service dist>] [-r <trace file>] "	\
+	"[-c <connections>] [-b <batch>] [-P <protocol>] [-h <address>] " \
+	"[-R <seed>] [-v] <port number>\n"
+
+/* Defaults of the parameters */
+#define LOADGEN_DEFAULT_ARRIVAL 1000.0
+#define LOADGEN_DEFAULT_SERVICE 2000.0
+#define LOADGEN_DEFAULT_COUNT 1000
+
+/* Below this much time before the next send, spin instead of sleeping,
+ * in nanoseconds */
+#define LOADGEN_SPIN_NS (50 * 1000)
+
+/* How long to wait for the last responses once everything is sent,
+ * and how often the receiver checks, in milliseconds */
+#define LOADGEN_DRAIN_MS 5000
+#define LOADGEN_POLL_MS 100
+
+/* Shape of the Pareto distribution */
+#define LOADGEN_PARETO_SHAPE 1.5
+
+/* Bimodal distribution: probability of a long value, and the short and
+ * long values as multiples of the mean */
+#define LOADGEN_BIMODAL_P 0.1
+#define LOADGEN_BIMODAL_SHORT 0.5
+#define LOADGEN_BIMODAL_LONG 5.5
+
+/* Size of the receive buffer of a connection */
+#define LOADGEN_RX_SIZE (PROTO_MAX_BATCH * sizeof(struct response))
+
+/* Distribution of the inter-arrival times or of the request lengths */
+enum loadgen_dist {
+	DIST_EXP = 0,
+	DIST_UNIFORM,
+	DIST_BIMODAL,
+	DIST_PARETO,
+	DIST_FIXED,
+	DIST_TRACE,
+	DIST_COUNT,
+};
+
+static const char * dist_names[DIST_COUNT] = {
+	[DIST_EXP] = "exp",
+	[DIST_UNIFORM] = "uniform",
+	[DIST_BIMODAL] = "bimodal",
+	[DIST_PARETO] = "pareto",
+	[DIST_FIXED] = "fixed",
+	[DIST_TRACE] = "trace",
+};
+
+/* One request: its schedule, and what happened to it */
+struct loadgen_req {
+	nstime_t due_ns;	/* Scheduled send time, from the start */
+	nstime_t length_ns;
+	nstime_t sent_ns;
+	nstime_t recv_ns;	/* 0 until the response arrives */
+	uint8_t ack;
+};
+
+/* One connection to the server */
+struct loadgen_conn {
+	int fd;
+	int proto;
+
+	/* Bytes of responses not parsed yet. Only the receiver touches
+	 * these. */
+	uint8_t rx_buf[LOADGEN_RX_SIZE];
+	size_t rx_len;
+};
+
+struct loadgen {
+	struct loadgen_req * reqs;
+	size_t count;
+
+	struct loadgen_conn * conns;
+	int nr_conns;
+
+	/* Set by the sender once every request is out */
+	atomic_int sent_all;
+
+	/* Responses received so far, only touched by the receiver */
+	size_t received;
+
+	pthread_t receiver;
+};
+
+/* Translate a distribution name into a distribution. "poisson" is
+ * accepted for exp. Returns -1 if the name is not recognized. */
+static int parse_dist(const char * name)
+{
+	int i;
+
+	if (strcasecmp(name, "poisson") == 0)
+		return DIST_EXP;
+
+	for (i = 0; i < DIST_COUNT; ++i)
+		if (strcasecmp(name, dist_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Return a uniform random number in (0, 1], advancing the xorshift
+ * state <rng> */
+static double rng_uniform(uint64_t * rng)
+{
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return (((*rng * 0x2545F4914F6CDD1DULL) >> 11) + 1) * 0x1.0p-53;
+}
+
+/* Draw a value of the distribution <dist> (other than trace) with
+ * mean <mean> */
+static double dist_sample(enum loadgen_dist dist, double mean, uint64_t * rng)
+{
+	double u = rng_uniform(rng);
+	double a = LOADGEN_PARETO_SHAPE;
+
+	switch (dist) {
+	case DIST_UNIFORM:
+		return 2 * mean * u;
+	case DIST_BIMODAL:
+		return mean * (u <= LOADGEN_BIMODAL_P ? LOADGEN_BIMODAL_LONG
+			       : LOADGEN_BIMODAL_SHORT);
+	case DIST_PARETO:
+		return mean * (a - 1) / a / pow(u, 1 / a);
+	case DIST_FIXED:
+		return mean;
+	case DIST_EXP:
+	default:
+		return -mean * log(u);
+	}
+}
+
+/* Compare two trace records by send time, for qsort() */
+static int trace_cmp(const void * a, const void * b)
+{
+	int64_t sa = ((const struct trace_record *)a)->sent_ns;
+	int64_t sb = ((const struct trace_record *)b)->sent_ns;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/* Read all the records of the trace <path>, sorted by send time, into
+ * a newly allocated array. Returns the number of records, or -1. */
+static ssize_t load_trace(const char * path, struct trace_record ** records)
+{
+	struct trace_record * recs = NULL, * grown;
+	size_t count = 0, size = 0;
+	FILE * in;
+
+	in = fopen(path, "rb");
+	if (in == NULL)
+		return -1;
+
+	if (trace_read_header(in) < 0) {
+		fclose(in);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		if (count == size) {
+			size = (size ? 2 * size : 1024);
+			grown = (struct trace_record *)realloc(recs, size * sizeof(*recs));
+			if (grown == NULL) {
+				free(recs);
+				fclose(in);
+				return -1;
+			}
+			recs = grown;
+		}
+
+		if (trace_read(in, &recs[count]) < 0)
+			break;
+		count++;
+	}
+
+	fclose(in);
+	qsort(recs, count, sizeof(*recs), trace_cmp);
+	*records = recs;
+	return count;
+}
+
+/* Draw the send times and lengths of all the requests. The trace
+ * distribution replays <trace> (of <trace_len> records) over and over
+ * if more requests than records are needed. */
+static void make_schedule(struct loadgen * lg, enum loadgen_dist arrival,
+			  double arrival_rate, enum loadgen_dist service,
+			  double service_rate, struct trace_record * trace,
+			  size_t trace_len, uint64_t seed, int proto)
+{
+	double gap_mean = NANO_IN_SEC / arrival_rate;
+	double length_mean = NANO_IN_SEC / service_rate;
+	nstime_t due = 0, gap, length;
+	size_t i, k;
+
+	for (i = 0; i < lg->count; ++i) {
+		k = i % (trace_len ? trace_len : 1);
+
+		if (arrival != DIST_TRACE)
+			gap = dist_sample(arrival, gap_mean, &seed);
+		else if (k > 0)
+			gap = trace[k].sent_ns - trace[k - 1].sent_ns;
+		else
+			gap = 0;
+
+		if (service != DIST_TRACE)
+			length = dist_sample(service, length_mean, &seed);
+		else
+			length = trace[k].length_ns;
+
+		/* The first request goes out right away */
+		if (i > 0)
+			due += gap;
+		if (proto > PROTO_LEGACY && length > UINT32_MAX)
+			length = UINT32_MAX;
+
+		lg->reqs[i].due_ns = due;
+		lg->reqs[i].length_ns = length;
+	}
+}
+
+/* Open a connection to the server and, for the compact protocol, agree
+ * on the version. Returns 0 on success and -1 on failure. */
+static int loadgen_connect(struct loadgen_conn * conn, struct sockaddr_in * addr, int proto)
+{
+	uint8_t hello[PROTO_HELLO_SIZE];
+	size_t got;
+	ssize_t bytes;
+	int optval = 1;
+
+	conn->rx_len = 0;
+	conn->proto = PROTO_LEGACY;
+	conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (conn->fd < 0)
+		return -1;
+
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+	if (connect(conn->fd, (struct sockaddr *)addr, sizeof(*addr)) < 0)
+		goto err_close;
+
+	if (proto == PROTO_LEGACY)
+		return 0;
+
+	proto_write_hello(hello, proto);
+	if (send(conn->fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello))
+		goto err_close;
+
+	for (got = 0; got < sizeof(hello); got += bytes) {
+		bytes = recv(conn->fd, hello + got, sizeof(hello) - got, 0);
+		if (bytes <= 0)
+			goto err_close;
+	}
+
+	conn->proto = proto_read_hello(hello);
+	if (conn->proto < 0 || conn->proto > proto) {
+		errno = EPROTO;
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(conn->fd);
+	conn->fd = -1;
+	return -1;
+}
+
+/* Write all of <len> bytes from <buf> to the connection. Returns 0 on
+ * success and -1 if the server is gone. */
+static int send_all(struct loadgen_conn * conn, const void * buf, size_t len)
+{
+	ssize_t bytes;
+
+	while (len > 0) {
+		bytes = send(conn->fd, buf, len, MSG_NOSIGNAL);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		buf = (const char *)buf + bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/* Send the <count> requests starting at <first> together on <conn>,
+ * stamping them with the current time. Returns 0 on success and -1 if
+ * the server is gone. */
+static int send_requests(struct loadgen * lg, struct loadgen_conn * conn,
+			 size_t first, size_t count)
+{
+	struct request legacy[PROTO_MAX_BATCH];
+	struct proto_request reqs[PROTO_MAX_BATCH];
+	uint8_t frame[PROTO_MAX_REQ_FRAME];
+	size_t i, len, done, encoded;
+	nstime_t now = now_ns();
+
+	for (i = 0; i < count; ++i) {
+		lg->reqs[first + i].sent_ns = now;
+		reqs[i].req_id = first + i;
+		reqs[i].sent_ns = now;
+		reqs[i].length_ns = lg->reqs[first + i].length_ns;
+	}
+
+	if (conn->proto == PROTO_LEGACY) {
+		memset(legacy, 0, count * sizeof(struct request));
+		for (i = 0; i < count; ++i) {
+			legacy[i].req_id = reqs[i].req_id;
+			legacy[i].req_timestamp = ns_to_timespec(reqs[i].sent_ns);
+			legacy[i].req_length = ns_to_timespec(reqs[i].length_ns);
+		}
+		return send_all(conn, legacy, count * sizeof(struct request));
+	}
+
+	for (done = 0; done < count; done += encoded) {
+		len = proto_encode_requests(frame, &reqs[done], count - done, &encoded);
+		if (encoded == 0 || send_all(conn, frame, len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Record the response <resp> received at <now> */
+static void record_response(struct loadgen * lg, struct response * resp, nstime_t now)
+{
+	struct loadgen_req * req;
+
+	if (resp->req_id >= lg->count)
+		return;
+
+	req = &lg->reqs[resp->req_id];
+	if (req->recv_ns != 0)
+		return;
+
+	req->recv_ns = now;
+	req->ack = resp->ack;
+	lg->received++;
+}
+
+/* Parse the complete responses in the receive buffer of <conn>.
+ * Returns -1 if the server sent garbage, 0 otherwise. */
+static int parse_responses(struct loadgen * lg, struct loadgen_conn * conn, nstime_t now)
+{
+	struct response resps[PROTO_MAX_BATCH];
+	size_t offset = 0, i, count;
+	ssize_t size;
+
+	while (conn->proto == PROTO_LEGACY
+	       && conn->rx_len - offset >= sizeof(struct response)) {
+		memcpy(&resps[0], conn->rx_buf + offset, sizeof(struct response));
+		offset += sizeof(struct response);
+		record_response(lg, &resps[0], now);
+	}
+
+	while (conn->proto > PROTO_LEGACY) {
+		size = proto_frame_size(conn->rx_buf + offset, conn->rx_len - offset,
+					PROTO_FRAME_RESPONSES);
+		if (size < 0)
+			return -1;
+		if (size == 0 || (size_t)size > conn->rx_len - offset)
+			break;
+
+		count = proto_decode_responses(conn->rx_buf + offset, resps);
+		offset += size;
+		for (i = 0; i < count; ++i)
+			record_response(lg, &resps[i], now);
+	}
+
+	conn->rx_len -= offset;
+	if (conn->rx_len > 0 && offset > 0)
+		memmove(conn->rx_buf, conn->rx_buf + offset, conn->rx_len);
+
+	return 0;
+}
+
+/* Main logic of the receiver thread: collect the responses on all the
+ * connections until every request is answered, the server is gone, or
+ * it stopped answering for LOADGEN_DRAIN_MS after the last send */
+static void * receiver_main(void * arg)
+{
+	struct loadgen * lg = (struct loadgen *)arg;
+	struct epoll_event ev, events[8];
+	struct loadgen_conn * conn;
+	nstime_t now, last = now_ns();
+	int epoll_fd, nr_open = 0, n, i;
+	ssize_t bytes;
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		perror("Unable to create epoll instance");
+		return NULL;
+	}
+
+	for (i = 0; i < lg->nr_conns; ++i) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &lg->conns[i];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lg->conns[i].fd, &ev) == 0)
+			nr_open++;
+	}
+
+	while (lg->received < lg->count && nr_open > 0) {
+		n = epoll_wait(epoll_fd, events, 8, LOADGEN_POLL_MS);
+		now = now_ns();
+
+		if (n <= 0) {
+			if (atomic_load_explicit(&lg->sent_all, memory_order_acquire)
+			    && now - last > (nstime_t)LOADGEN_DRAIN_MS * 1000 * 1000)
+				break;
+			continue;
+		}
+
+		for (i = 0; i < n; ++i) {
+			conn = (struct loadgen_conn *)events[i].data.ptr;
+			bytes = recv(conn->fd, conn->rx_buf + conn->rx_len,
+				     LOADGEN_RX_SIZE - conn->rx_len, 0);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+
+			if (bytes <= 0) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+				nr_open--;
+				continue;
+			}
+
+			conn->rx_len += bytes;
+			if (parse_responses(lg, conn, now) < 0) {
+				fprintf(stderr, "Invalid response frame\n");
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+				nr_open--;
+			}
+		}
+
+		last = now;
+	}
+
+	close(epoll_fd);
+	return NULL;
+}
+
+/* Wait until the absolute time <due>, sleeping if it is far enough */
+static void wait_until(nstime_t due)
+{
+	struct timespec delay;
+	nstime_t now;
+
+	while ((now = now_ns()) < due) {
+		if (due - now > LOADGEN_SPIN_NS) {
+			delay = ns_to_timespec(due - now - LOADGEN_SPIN_NS);
+			nanosleep(&delay, NULL);
+		} else {
+			cpu_relax();
+		}
+	}
+}
+
+/* Send all the requests on schedule, spreading them over the
+ * connections. Returns the time the first request went out. */
+static nstime_t run_sender(struct loadgen * lg, size_t batch)
+{
+	nstime_t start = now_ns(), now;
+	size_t i = 0, count;
+	int c = 0;
+
+	while (i < lg->count) {
+		wait_until(start + lg->reqs[i].due_ns);
+		now = now_ns();
+
+		/* Send everything that is due by now together */
+		for (count = 1; count < batch && i + count < lg->count; ++count)
+			if (start + lg->reqs[i + count].due_ns > now)
+				break;
+
+		if (send_requests(lg, &lg->conns[c], i, count) < 0) {
+			perror("Unable to send requests");
+			break;
+		}
+
+		i += count;
+		c = (c + 1) % lg->nr_conns;
+	}
+
+	atomic_store_explicit(&lg->sent_all, 1, memory_order_release);
+	return start;
+}
+
+/* Print one line per request, and the summary of the run */
+static void print_results(struct loadgen * lg, nstime_t start, int verbose)
+{
+	struct hist response;
+	struct loadgen_req * req;
+	uint64_t completed = 0, rejected = 0, sent = 0;
+	nstime_t last_sent = start, last_recv = start, lag, max_lag = 0;
+	double lag_sum = 0, span;
+	size_t i;
+
+	hist_init(&response);
+
+	for (i = 0; i < lg->count; ++i) {
+		req = &lg->reqs[i];
+		if (req->sent_ns == 0)
+			continue;
+
+		sent++;
+		lag = req->sent_ns - (start + req->due_ns);
+		lag_sum += lag;
+		if (lag > max_lag)
+			max_lag = lag;
+		if (req->sent_ns > last_sent)
+			last_sent = req->sent_ns;
+
+		if (verbose)
+			printf("[#LOADGEN#] R[%lu]: Sent: " NSTIME_FMT " Recv: " NSTIME_FMT
+			       " Len: " NSTIME_FMT " Rejected: %s\n", i,
+			       NSTIME_ARGS(req->sent_ns), NSTIME_ARGS(req->recv_ns),
+			       NSTIME_ARGS(req->length_ns),
+			       (req->recv_ns == 0 ? "Lost" : (req->ack == RESP_REJECTED ? "Yes" : "No")));
+
+		if (req->recv_ns == 0)
+			continue;
+		if (req->recv_ns > last_recv)
+			last_recv = req->recv_ns;
+
+		if (req->ack == RESP_REJECTED) {
+			rejected++;
+			continue;
+		}
+
+		completed++;
+		hist_record(&response, req->recv_ns - req->sent_ns);
+	}
+
+	span = (double)(last_sent - start) / NANO_IN_SEC;
+	printf("[#LOADGEN#] INFO: Sent %lu requests in %lf s (%lf req/s)\n",
+	       sent, span, (span > 0 ? sent / span : 0));
+	printf("[#LOADGEN#] INFO: Send lag: mean %lf max %lf\n",
+	       (sent > 0 ? lag_sum / sent / NANO_IN_SEC : 0),
+	       (double)max_lag / NANO_IN_SEC);
+
+	span = (double)(last_recv - start) / NANO_IN_SEC;
+	printf("[#LOADGEN#] INFO: Completed %lu, rejected %lu, unanswered %lu "
+	       "(%lf completions/s)\n", completed, rejected,
+	       sent - completed - rejected, (span > 0 ? completed / span : 0));
+	fprint_hist(stdout, "loadgen", "Response time", &response);
+}
+
+int main (int argc, char ** argv) {
+	struct loadgen lg;
+	struct sockaddr_in addr;
+	struct trace_record * trace = NULL;
+	ssize_t trace_len = 0;
+	double arrival_rate = LOADGEN_DEFAULT_ARRIVAL;
+	double service_rate = LOADGEN_DEFAULT_SERVICE;
+	int arrival = DIST_EXP, service = DIST_EXP;
+	const char * trace_path = NULL, * host = "127.0.0.1";
+	long count = -1, batch = PROTO_MAX_BATCH, conns = 1;
+	int opt, proto = PROTO_VERSION, verbose = 0, port, i;
+	uint64_t seed = now_ns();
+	nstime_t start;
+
+	while ((opt = getopt(argc, argv, "a:s:n:d:e:r:c:b:P:h:R:v")) != -1) {
+		switch (opt) {
+		case 'a':
+			arrival_rate = strtod(optarg, NULL);
+			break;
+		case 's':
+			service_rate = strtod(optarg, NULL);
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			arrival = parse_dist(optarg);
+			break;
+		case 'e':
+			service = parse_dist(optarg);
+			break;
+		case 'r':
+			trace_path = optarg;
+			break;
+		case 'c':
+			conns = strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			batch = strtol(optarg, NULL, 10);
+			break;
+		case 'P':
+			proto = strtol(optarg, NULL, 10);
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'R':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || arrival < 0 || service < 0 || arrival_rate <= 0
+	    || service_rate <= 0 || count == 0 || conns <= 0 || batch <= 0
+	    || batch > PROTO_MAX_BATCH || proto < PROTO_LEGACY || proto > PROTO_VERSION
+	    || ((arrival == DIST_TRACE || service == DIST_TRACE) && trace_path == NULL)) {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	port = strtol(argv[optind], NULL, 10);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		ERROR_INFO();
+		fprintf(stderr, "Invalid server address: %s\n", host);
+		return EXIT_FAILURE;
+	}
+
+	if (trace_path != NULL) {
+		trace_len = load_trace(trace_path, &trace);
+		if (trace_len <= 0) {
+			ERROR_INFO();
+			fprintf(stderr, "Unable to read trace %s\n", trace_path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* By default, replay the trace once */
+	if (count < 0)
+		count = (trace_len > 0 ? trace_len : LOADGEN_DEFAULT_COUNT);
+	if (seed == 0)
+		seed = 1;
+
+	printf("[#LOADGEN#] INFO: arrivals %s at %lf req/s, lengths %s at %lf req/s, "
+	       "%ld requests, seed %lu\n", dist_names[arrival], arrival_rate,
+	       dist_names[service], service_rate, count, seed);
+
+	memset(&lg, 0, sizeof(lg));
+	lg.count = count;
+	lg.nr_conns = conns;
+	lg.reqs = (struct loadgen_req *)calloc(count, sizeof(struct loadgen_req));
+	lg.conns = (struct loadgen_conn *)calloc(conns, sizeof(struct loadgen_conn));
+	if (lg.reqs == NULL || lg.conns == NULL) {
+		ERROR_INFO();
+		perror("Unable to allocate memory");
+		return EXIT_FAILURE;
+	}
+	atomic_init(&lg.sent_all, 0);
+
+	make_schedule(&lg, arrival, arrival_rate, service, service_rate,
+		      trace, trace_len, seed, proto);
+	free(trace);
+
+	for (i = 0; i < conns; ++i) {
+		if (loadgen_connect(&lg.conns[i], &addr, proto) < 0) {
+			ERROR_INFO();
+			perror("Unable to connect to the server");
+			return EXIT_FAILURE;
+		}
+	}
+	printf("[#LOADGEN#] INFO: %ld connections, protocol version %d\n",
+	       conns, lg.conns[0].proto);
+
+	if (pthread_create(&lg.receiver, NULL, receiver_main, &lg) != 0) {
+		ERROR_INFO();
+		perror("Unable to start the receiver thread");
+		return EXIT_FAILURE;
+	}
+
+	start = run_sender(&lg, batch);
+	pthread_join(lg.receiver, NULL);
+
+	for (i = 0; i < conns; ++i)
+		close(lg.conns[i].fd);
+
+	print_results(&lg, start, verbose);
+
+	free(lg.conns);
+	free(lg.reqs);
+
+	return EXIT_SUCCESS;
+}
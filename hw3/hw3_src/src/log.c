@@ -0,0 +1,414 @@
+/*******************************************************************************
+* Asynchronous Request Log (implementation)
+*
+* Description:
+*     Moves the formatting and writing of the per-request log lines off the
+*     threads that handle requests. Each producer (every worker, plus the
+*     event loop for rejections) pushes fixed-size records into its own
+*     single-producer/single-consumer ring, and a dedicated logger thread
+*     drains all the rings and writes the records out, either in the usual
+*     text format (R/X lines followed by the queue status) or as compact
+*     binary trace records (see trace.h).
+*
+* Notes:
+*     The logger is started with pthread_create() directly rather than
+*     through thread.h: it does its own stdio, so it keeps a regular
+*     pthreads stack instead of a small worker stack.
+*
+*     Records from different producers are written in the order in which
+*     the logger drains them, so lines of different workers may appear
+*     slightly out of order with respect to their timestamps.
+*
+*     Everything printed about the queue after a completion is captured
+*     when the record is created: the snapshot for the summary, and the
+*     queued IDs for the full and split dumps. The logger may write the
+*     record much later, and the queue has moved on by then.
+*
+*******************************************************************************/
+
+#include <strings.h>
+
+#include "log.h"
+
+/* Names of the log formats, as accepted on the command line */
+static const char * format_names[] = {
+	[LOG_TEXT] = "text",
+	[LOG_BINARY] = "binary",
+};
+
+/* Translate a format name ("text" or "binary") into a log format.
+ * Returns -1 if the name is not recognized. */
+int log_parse_format(const char * name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(format_names) / sizeof(format_names[0]); ++i)
+		if (strcasecmp(name, format_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Take a snapshot of all the queues together: the lengths and work
+ * add up, and the oldest request is the oldest of any queue */
+static void log_snapshot(struct logger * logger, struct queue_snapshot * snap)
+{
+	struct queue_snapshot part;
+	int i;
+
+	memset(snap, 0, sizeof(*snap));
+	for (i = 0; i < logger->nr_queues; ++i) {
+		queue_snapshot(logger->queues[i], &part);
+		snap->length += part.length;
+		snap->work_ns += part.work_ns;
+		if (part.oldest_ns != 0 && (snap->oldest_ns == 0 || part.oldest_ns < snap->oldest_ns))
+			snap->oldest_ns = part.oldest_ns;
+	}
+}
+
+/* Print the queued IDs recorded with <rec>: those of all the queues on
+ * one Q line, or those of each queue on its own line if <split> */
+static void log_write_ids(struct logger * logger, struct log_ring * ring,
+			  struct log_record * rec, int split)
+{
+	uint64_t * ids = &ring->ids[rec->ids_pos & (logger->ids_size - 1)];
+	size_t i, count, pos = 0;
+	int q, first = 1;
+
+	if (!split)
+		fprintf(logger->out, "Q:[");
+
+	for (q = 0; q < logger->nr_queues; ++q) {
+		if (split) {
+			fprintf(logger->out, "Q%d:[", q);
+			first = 1;
+		}
+
+		count = ids[pos++];
+		for (i = 0; i < count; ++i, ++pos) {
+			fprintf(logger->out, "%sR%ld", (first ? "" : ","), ids[pos]);
+			first = 0;
+		}
+
+		if (split)
+			fprintf(logger->out, "]\n");
+	}
+
+	if (!split)
+		fprintf(logger->out, "]\n");
+}
+
+/* Write out one record of <ring> in the configured format */
+static void log_write(struct logger * logger, struct log_ring * ring,
+		      struct log_record * rec)
+{
+	struct trace_record trace;
+
+	if (logger->format == LOG_BINARY) {
+		trace.req_id = rec->req_id;
+		trace.sent_ns = rec->sent_ns;
+		trace.length_ns = rec->length_ns;
+		trace.receipt_ns = rec->receipt_ns;
+		trace.start_ns = rec->start_ns;
+		trace.completion_ns = rec->completion_ns;
+		trace.ack = (rec->type == LOG_REJECTED ? RESP_REJECTED : RESP_COMPLETED);
+		trace.worker = rec->worker;
+		trace.queue_len = rec->queue.length;
+		trace_write(logger->out, &trace);
+		return;
+	}
+
+	if (rec->type == LOG_REJECTED) {
+		fprintf(logger->out, "X%ld:" NSTIME_FMT "," NSTIME_FMT "," NSTIME_FMT "\n",
+			rec->req_id, NSTIME_ARGS(rec->sent_ns), NSTIME_ARGS(rec->length_ns),
+			NSTIME_ARGS(rec->completion_ns));
+		return;
+	}
+
+	if (rec->worker >= 0)
+		fprintf(logger->out, "T%d ", rec->worker);
+
+	fprintf(logger->out, "R%ld:" NSTIME_FMT "," NSTIME_FMT "," NSTIME_FMT ","
+		NSTIME_FMT "," NSTIME_FMT "\n", rec->req_id,
+		NSTIME_ARGS(rec->sent_ns), NSTIME_ARGS(rec->length_ns),
+		NSTIME_ARGS(rec->receipt_ns), NSTIME_ARGS(rec->start_ns),
+		NSTIME_ARGS(rec->completion_ns));
+
+	if (logger->nr_queues == 0)
+		return;
+
+	/* All of these were captured at completion time */
+	switch (logger->dump) {
+	case QUEUE_DUMP_FULL:
+		log_write_ids(logger, ring, rec, 0);
+		break;
+	case QUEUE_DUMP_SPLIT:
+		log_write_ids(logger, ring, rec, 1);
+		break;
+	case QUEUE_DUMP_SUMMARY:
+		fdump_queue_snapshot(logger->out, &rec->queue);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Write out all the records currently in a ring. Returns the number
+ * of records written. */
+static size_t log_drain(struct logger * logger, struct log_ring * ring)
+{
+	struct log_record * rec;
+	size_t head, tail, count, ids_head = 0;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	for (count = 0; head + count < tail; ++count) {
+		rec = &ring->records[(head + count) & (LOG_RING_SIZE - 1)];
+		log_write(logger, ring, rec);
+		if (rec->ids_len > 0)
+			ids_head = rec->ids_pos + rec->ids_len;
+	}
+
+	/* Hand all the slots (and IDs) back to the producer at once */
+	if (ids_head > 0)
+		atomic_store_explicit(&ring->ids_head, ids_head, memory_order_release);
+	if (count > 0)
+		atomic_store_explicit(&ring->head, tail, memory_order_release);
+
+	return count;
+}
+
+/* Main logic of the logger thread: keep draining the rings until asked
+ * to stop, then do a last pass so that no record is lost. */
+static void * logger_main(void * arg)
+{
+	struct logger * logger = (struct logger *)arg;
+	struct timespec idle = {0, LOG_IDLE_SLEEP_US * 1000};
+	size_t written;
+	int i, done;
+
+	for (;;) {
+		/* Check the flag first: producers are stopped before it is
+		 * set, so a full pass after seeing it drains everything. */
+		done = atomic_load_explicit(&logger->done, memory_order_acquire);
+
+		written = 0;
+		for (i = 0; i < logger->producers; ++i)
+			written += log_drain(logger, &logger->rings[i]);
+
+		if (written > 0)
+			continue;
+
+		if (done)
+			break;
+
+		/* Nothing to do: push out what we have and take a nap */
+		fflush(logger->out);
+		nanosleep(&idle, NULL);
+	}
+
+	fflush(logger->out);
+	return NULL;
+}
+
+/* Create a logger with one ring for each of <producers> producers and
+ * start its thread. Records are written to <out> in the given format;
+ * in text mode, the status of the <nr_queues> queues in <queues>
+ * follows every completion as selected by <dump>, while in binary mode
+ * the trace header is written first. Several queues are reported as if
+ * they were one. Returns NULL on failure. */
+struct logger * log_create(FILE * out, enum log_format format, int producers,
+			   struct queue ** queues, int nr_queues, enum queue_dump dump)
+{
+	struct logger * logger;
+	int i;
+
+	if (producers <= 0)
+		return NULL;
+
+	logger = (struct logger *)malloc(sizeof(struct logger));
+	if (logger == NULL)
+		return NULL;
+
+	logger->out = out;
+	logger->format = format;
+	logger->queues = queues;
+	logger->nr_queues = (queues ? nr_queues : 0);
+	logger->dump = dump;
+	logger->producers = producers;
+	atomic_init(&logger->done, 0);
+
+	/* The full and split dumps need room for the IDs of every queued
+	 * request, plus one count per queue, several times over */
+	logger->ids_size = logger->ids_max = 0;
+	if (format == LOG_TEXT && (dump == QUEUE_DUMP_FULL || dump == QUEUE_DUMP_SPLIT)) {
+		for (i = 0; i < logger->nr_queues; ++i)
+			logger->ids_max += queues[i]->max_size + 1;
+		if (logger->ids_max > 0)
+			for (logger->ids_size = 1;
+			     logger->ids_size < LOG_IDS_DUMPS * logger->ids_max;
+			     logger->ids_size *= 2)
+				;
+	}
+
+	logger->rings = (struct log_ring *)
+		aligned_alloc(CACHE_LINE_SIZE,
+			      CACHE_LINE_ROUND(producers * sizeof(struct log_ring)));
+	if (logger->rings == NULL)
+		goto err_free_logger;
+
+	for (i = 0; i < producers; ++i) {
+		atomic_init(&logger->rings[i].head, 0);
+		atomic_init(&logger->rings[i].ids_head, 0);
+		atomic_init(&logger->rings[i].tail, 0);
+		logger->rings[i].ids_tail = 0;
+		logger->rings[i].stalls = 0;
+		logger->rings[i].ids = NULL;
+	}
+
+	for (i = 0; i < producers && logger->ids_size > 0; ++i) {
+		logger->rings[i].ids = (uint64_t *)malloc(logger->ids_size * sizeof(uint64_t));
+		if (logger->rings[i].ids == NULL)
+			goto err_free_rings;
+	}
+
+	if (format == LOG_BINARY && trace_write_header(out) < 0)
+		goto err_free_rings;
+
+	if (pthread_create(&logger->thread, NULL, logger_main, logger) != 0)
+		goto err_free_rings;
+
+	return logger;
+
+err_free_rings:
+	for (i = 0; i < producers; ++i)
+		free(logger->rings[i].ids);
+	free(logger->rings);
+err_free_logger:
+	free(logger);
+	return NULL;
+}
+
+/* Write out all the records still pending, stop the logger thread and
+ * release its memory */
+void log_destroy(struct logger * logger)
+{
+	uint64_t stalls = 0;
+	int i;
+
+	atomic_store_explicit(&logger->done, 1, memory_order_release);
+	pthread_join(logger->thread, NULL);
+
+	for (i = 0; i < logger->producers; ++i)
+		stalls += logger->rings[i].stalls;
+
+	if (stalls > 0)
+		printf("INFO: Logger fell behind %lu times\n", stalls);
+
+	for (i = 0; i < logger->producers; ++i)
+		free(logger->rings[i].ids);
+	free(logger->rings);
+	free(logger);
+}
+
+/* Append a record to the ring of <producer>, waiting for the logger to
+ * make room if the ring is full */
+static void log_push(struct logger * logger, int producer, struct log_record * rec)
+{
+	struct log_ring * ring = &logger->rings[producer];
+	size_t tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOG_RING_SIZE) {
+		ring->stalls++;
+		while (tail - atomic_load_explicit(&ring->head, memory_order_acquire)
+		       >= LOG_RING_SIZE)
+			cpu_relax();
+	}
+
+	ring->records[tail & (LOG_RING_SIZE - 1)] = *rec;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Record the IDs of the requests now in the queues into the ID buffer
+ * of <ring>, for <rec>, waiting for the logger to make room if needed */
+static void log_capture_ids(struct logger * logger, struct log_ring * ring,
+			    struct log_record * rec)
+{
+	size_t pos, offset, count, len = 0;
+	int i;
+
+	/* Keep the IDs of a record contiguous: skip the end of the buffer
+	 * if the largest possible dump might not fit there */
+	pos = ring->ids_tail;
+	offset = pos & (logger->ids_size - 1);
+	if (offset + logger->ids_max > logger->ids_size)
+		pos += logger->ids_size - offset;
+
+	if (pos + logger->ids_max - atomic_load_explicit(&ring->ids_head, memory_order_acquire)
+	    > logger->ids_size) {
+		ring->stalls++;
+		while (pos + logger->ids_max
+		       - atomic_load_explicit(&ring->ids_head, memory_order_acquire)
+		       > logger->ids_size)
+			cpu_relax();
+	}
+
+	offset = pos & (logger->ids_size - 1);
+	for (i = 0; i < logger->nr_queues; ++i) {
+		count = queue_copy_ids(logger->queues[i], &ring->ids[offset + len + 1]);
+		ring->ids[offset + len] = count;
+		len += count + 1;
+	}
+
+	rec->ids_pos = pos;
+	rec->ids_len = len;
+	ring->ids_tail = pos + len;
+}
+
+/* Log the completion of <req> by worker <worker>. Must only be called
+ * by the owner of ring <producer>. */
+void log_completed(struct logger * logger, int producer, int worker,
+		   struct request_meta * req)
+{
+	struct log_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LOG_COMPLETED;
+	rec.ids_len = 0;
+	rec.worker = worker;
+	rec.req_id = req->req_id;
+	rec.sent_ns = req->sent_ns;
+	rec.length_ns = req->length_ns;
+	rec.receipt_ns = req->receipt_ns;
+	rec.start_ns = req->start_ns;
+	rec.completion_ns = req->completion_ns;
+	log_snapshot(logger, &rec.queue);
+	if (logger->ids_size > 0)
+		log_capture_ids(logger, &logger->rings[producer], &rec);
+
+	log_push(logger, producer, &rec);
+}
+
+/* Log the rejection of <req> at time <reject_ns>. Must only be
+ * called by the owner of ring <producer>. */
+void log_rejected(struct logger * logger, int producer, struct request_meta * req,
+		  nstime_t reject_ns)
+{
+	struct log_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = LOG_REJECTED;
+	rec.ids_len = 0;
+	rec.worker = -1;
+	rec.req_id = req->req_id;
+	rec.sent_ns = req->sent_ns;
+	rec.length_ns = req->length_ns;
+	rec.receipt_ns = req->receipt_ns;
+	rec.completion_ns = reject_ns;
+	log_snapshot(logger, &rec.queue);
+
+	log_push(logger, producer, &rec);
+}
@@ -0,0 +1,140 @@
+/*******************************************************************************
+* Asynchronous Request Log (header)
+*
+* Description:
+*     Moves the formatting and writing of the per-request log lines off the
+*     threads that handle requests. Each producer (every worker, plus the
+*     event loop for rejections) pushes fixed-size records into its own
+*     single-producer/single-consumer ring, and a dedicated logger thread
+*     drains all the rings and writes the records out, either in the usual
+*     text format (R/X lines followed by the queue status) or as compact
+*     binary trace records (see trace.h).
+*
+* Notes:
+*     A producer never blocks on the output. It only waits, spinning, if
+*     its ring (or the ID buffer next to it) is full because the logger
+*     fell behind, which is counted and reported at shutdown. With a full
+*     or split queue dump, each completion copies the IDs of the queued
+*     requests, so the summary dump remains the cheap one.
+*
+*******************************************************************************/
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "queue.h"
+#include "trace.h"
+
+/* Number of records in the ring of each producer. Must be a power of
+ * two. */
+#define LOG_RING_SIZE 4096
+
+/* Room for the queued IDs recorded with the completions in each ring,
+ * as a number of dumps of full queues */
+#define LOG_IDS_DUMPS 8
+
+/* How long the logger sleeps when there is nothing to write, in
+ * microseconds */
+#define LOG_IDLE_SLEEP_US 1000
+
+/* Format of the log output */
+enum log_format {
+	LOG_TEXT = 0,		/* Human-readable R/X/Q lines */
+	LOG_BINARY,		/* Binary trace, see trace.h */
+};
+
+/* Kind of event described by a record */
+enum log_type {
+	LOG_COMPLETED = 'R',	/* Request processed by a worker */
+	LOG_REJECTED = 'X',	/* Request rejected on arrival */
+};
+
+/* One entry of the log, with all the times in nanoseconds. For a
+ * rejected request, completion_ns holds the time of the rejection. A
+ * negative worker means that the worker ID is not printed. queue is a
+ * snapshot of the queue taken when the record was created. With a full
+ * or split queue dump, the IDs of the queued requests at that time are
+ * stored in the ID buffer of the ring from position ids_pos on: for
+ * each queue, the number of its IDs followed by the IDs. */
+struct log_record {
+	uint8_t type;
+	int16_t worker;
+	struct queue_snapshot queue;
+	uint64_t req_id;
+	nstime_t sent_ns;
+	nstime_t length_ns;
+	nstime_t receipt_ns;
+	nstime_t start_ns;
+	nstime_t completion_ns;
+	size_t ids_pos;
+	uint32_t ids_len;
+};
+
+/* Ring of records written by exactly one producer and read by the
+ * logger thread, and the buffer of queued IDs that goes with it.
+ * Positions only ever grow. */
+struct log_ring {
+	atomic_size_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	atomic_size_t ids_head;
+	atomic_size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t ids_tail;
+	uint64_t stalls __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t * ids;
+	struct log_record records[LOG_RING_SIZE];
+};
+
+struct logger {
+	FILE * out;
+	enum log_format format;
+
+	/* Queues whose combined snapshot is recorded with every entry, and
+	 * what is printed about them after every completion in text mode */
+	struct queue ** queues;
+	int nr_queues;
+	enum queue_dump dump;
+
+	/* Size of the ID buffer of each ring (a power of two, or 0 if the
+	 * IDs are not recorded), and the most IDs one record can take */
+	size_t ids_size;
+	size_t ids_max;
+
+	int producers;
+	struct log_ring * rings;
+
+	atomic_int done;
+	pthread_t thread;
+};
+
+/* Translate a format name ("text" or "binary") into a log format.
+ * Returns -1 if the name is not recognized. */
+int log_parse_format(const char * name);
+
+/* Create a logger with one ring for each of <producers> producers and
+ * start its thread. Records are written to <out> in the given format;
+ * in text mode, the status of the <nr_queues> queues in <queues>
+ * follows every completion as selected by <dump>, while in binary mode
+ * the trace header is written first. Several queues are reported as if
+ * they were one. Returns NULL on failure. */
+struct logger * log_create(FILE * out, enum log_format format, int producers,
+			   struct queue ** queues, int nr_queues, enum queue_dump dump);
+
+/* Write out all the records still pending, stop the logger thread and
+ * release its memory */
+void log_destroy(struct logger * logger);
+
+/* Log the completion of <req> by worker <worker>. Must only be called
+ * by the owner of ring <producer>. */
+void log_completed(struct logger * logger, int producer, int worker,
+		   struct request_meta * req);
+
+/* Log the rejection of <req> at time <reject_ns>. Must only be
+ * called by the owner of ring <producer>. */
+void log_rejected(struct logger * logger, int producer, struct request_meta * req,
+		  nstime_t reject_ns);
+
+#endif
@@ -0,0 +1,298 @@
+/*******************************************************************************
+* Live Metrics (implementation)
+*
+* Description:
+*     Counters of the requests handled by the servers, and the thread
+*     serving snapshots of them on a local UNIX socket.
+*
+* Notes:
+*     Snapshots are formatted into memory first and then sent with
+*     MSG_NOSIGNAL, so that a client going away early cannot kill the
+*     server with SIGPIPE. The endpoint serves one client at a time.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Allocate the counters of <nr_workers> workers, whose latency
+ * histograms are in the array <latency>, reporting the depth of the
+ * <nr_queues> queues in <queues>. Returns NULL on failure. */
+struct metrics * metrics_create(int nr_workers, struct latency_hists * latency,
+				struct queue ** queues, int nr_queues)
+{
+	struct metrics * metrics;
+	int i;
+
+	metrics = (struct metrics *)aligned_alloc(CACHE_LINE_SIZE,
+							CACHE_LINE_ROUND(sizeof(struct metrics)));
+	if (metrics == NULL)
+		return NULL;
+
+	metrics->workers = (struct metrics_worker *)
+		aligned_alloc(CACHE_LINE_SIZE,
+			      CACHE_LINE_ROUND(nr_workers * sizeof(struct metrics_worker)));
+	if (metrics->workers == NULL) {
+		free(metrics);
+		return NULL;
+	}
+
+	atomic_init(&metrics->accepted, 0);
+	atomic_init(&metrics->rejected, 0);
+	metrics->start_ns = now_ns();
+	metrics->nr_workers = nr_workers;
+	metrics->latency = latency;
+	metrics->queues = queues;
+	metrics->nr_queues = nr_queues;
+	metrics->path = NULL;
+	metrics->listen_fd = -1;
+	atomic_init(&metrics->done, 0);
+
+	for (i = 0; i < nr_workers; ++i) {
+		atomic_init(&metrics->workers[i].completed, 0);
+		atomic_init(&metrics->workers[i].stolen, 0);
+		atomic_init(&metrics->workers[i].busy_ns, 0);
+	}
+
+	return metrics;
+}
+
+/* Count the request <req> completed by worker <worker>, which it took
+ * from a sibling if <stolen> is set. Must only be called by the
+ * worker itself. */
+void metrics_completed(struct metrics * metrics, int worker,
+		       struct request_meta * req, int stolen)
+{
+	struct metrics_worker * w = &metrics->workers[worker];
+	uint64_t busy_ns = (req->completion_ns > req->start_ns
+			    ? req->completion_ns - req->start_ns : 0);
+
+	atomic_store_explicit(&w->completed,
+			      atomic_load_explicit(&w->completed, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+	if (stolen)
+		atomic_store_explicit(&w->stolen,
+				      atomic_load_explicit(&w->stolen, memory_order_relaxed) + 1,
+				      memory_order_relaxed);
+	if (busy_ns > 0)
+		atomic_store_explicit(&w->busy_ns,
+				      atomic_load_explicit(&w->busy_ns, memory_order_relaxed) + busy_ns,
+				      memory_order_relaxed);
+
+	latency_record(&metrics->latency[worker], req);
+}
+
+/* Print the summary of one histogram, in seconds */
+static void fprint_metrics_hist(FILE * out, const char * name, struct hist * hist,
+				enum metrics_format format)
+{
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	uint64_t sum_ns = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+	double mean = (count > 0 ? (double)sum_ns / count / NANO_IN_SEC : 0);
+	double p50 = (double)hist_percentile(hist, 50) / NANO_IN_SEC;
+	double p90 = (double)hist_percentile(hist, 90) / NANO_IN_SEC;
+	double p99 = (double)hist_percentile(hist, 99) / NANO_IN_SEC;
+	double p999 = (double)hist_percentile(hist, 99.9) / NANO_IN_SEC;
+	double max = (double)atomic_load_explicit(&hist->max_ns, memory_order_relaxed)
+		/ NANO_IN_SEC;
+
+	if (format == METRICS_JSON)
+		fprintf(out, ",\"%s\":{\"count\":%lu,\"mean\":%lf,\"p50\":%lf,"
+			"\"p90\":%lf,\"p99\":%lf,\"p99.9\":%lf,\"max\":%lf}",
+			name, count, mean, p50, p90, p99, p999, max);
+	else
+		fprintf(out, "%s: count %lu mean %lf p50 %lf p90 %lf p99 %lf "
+			"p99.9 %lf max %lf\n", name, count, mean, p50, p90, p99, p999, max);
+}
+
+/* Write a snapshot of all the metrics to <out> in the given format */
+void fprint_metrics(FILE * out, struct metrics * metrics, enum metrics_format format)
+{
+	uint64_t accepted, rejected, completed = 0, w_completed, busy_ns;
+	double uptime, busy;
+	size_t depth = 0;
+	int i;
+
+	uptime = (double)(now_ns() - metrics->start_ns) / NANO_IN_SEC;
+	accepted = atomic_load_explicit(&metrics->accepted, memory_order_relaxed);
+	rejected = atomic_load_explicit(&metrics->rejected, memory_order_relaxed);
+	for (i = 0; i < metrics->nr_workers; ++i)
+		completed += atomic_load_explicit(&metrics->workers[i].completed,
+						  memory_order_relaxed);
+	for (i = 0; i < metrics->nr_queues; ++i)
+		depth += queue_length(metrics->queues[i]);
+
+	if (format == METRICS_JSON) {
+		fprintf(out, "{\"uptime\":%lf,\"queue_depth\":%lu,\"queues\":[",
+			uptime, depth);
+		for (i = 0; i < metrics->nr_queues; ++i)
+			fprintf(out, "%s%lu", (i ? "," : ""), queue_length(metrics->queues[i]));
+		fprintf(out, "],\"accepted\":%lu,\"rejected\":%lu,\"completed\":%lu,"
+			"\"rejection_rate\":%lf,\"throughput\":%lf,\"workers\":[",
+			accepted, rejected, completed,
+			(accepted + rejected > 0 ? (double)rejected / (accepted + rejected) : 0),
+			(uptime > 0 ? completed / uptime : 0));
+	} else {
+		fprintf(out, "uptime: %lf\nqueue_depth: %lu\n", uptime, depth);
+		if (metrics->nr_queues > 1)
+			for (i = 0; i < metrics->nr_queues; ++i)
+				fprintf(out, "queue %d: %lu\n", i, queue_length(metrics->queues[i]));
+		fprintf(out, "accepted: %lu\nrejected: %lu\ncompleted: %lu\n"
+			"rejection_rate: %lf\nthroughput: %lf\n",
+			accepted, rejected, completed,
+			(accepted + rejected > 0 ? (double)rejected / (accepted + rejected) : 0),
+			(uptime > 0 ? completed / uptime : 0));
+	}
+
+	for (i = 0; i < metrics->nr_workers; ++i) {
+		w_completed = atomic_load_explicit(&metrics->workers[i].completed,
+						   memory_order_relaxed);
+		busy_ns = atomic_load_explicit(&metrics->workers[i].busy_ns,
+					       memory_order_relaxed);
+		busy = (uptime > 0 ? (double)busy_ns / NANO_IN_SEC / uptime : 0);
+
+		if (format == METRICS_JSON)
+			fprintf(out, "%s{\"id\":%d,\"completed\":%lu,\"stolen\":%lu,\"busy\":%lf}",
+				(i ? "," : ""), i, w_completed,
+				atomic_load_explicit(&metrics->workers[i].stolen,
+						     memory_order_relaxed), busy);
+		else
+			fprintf(out, "worker %d: completed %lu stolen %lu busy %lf\n",
+				i, w_completed,
+				atomic_load_explicit(&metrics->workers[i].stolen,
+						     memory_order_relaxed), busy);
+	}
+
+	if (format == METRICS_JSON)
+		fprintf(out, "]");
+
+	latency_merge(&metrics->merged, metrics->latency, metrics->nr_workers);
+	fprint_metrics_hist(out, "response", &metrics->merged.response, format);
+	fprint_metrics_hist(out, "queueing", &metrics->merged.queueing, format);
+	fprint_metrics_hist(out, "service", &metrics->merged.service, format);
+
+	if (format == METRICS_JSON)
+		fprintf(out, "}\n");
+}
+
+/* Read the request of a client, if any, and send it a snapshot */
+static void metrics_answer(struct metrics * metrics, int fd)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+	enum metrics_format format = METRICS_TEXT;
+	char request[64];
+	char * buf = NULL;
+	size_t len = 0, sent;
+	ssize_t bytes;
+	FILE * out;
+
+	/* Clients that send nothing get the default format */
+	if (poll(&pfd, 1, METRICS_POLL_MS) > 0) {
+		bytes = recv(fd, request, sizeof(request) - 1, 0);
+		if (bytes > 0) {
+			request[bytes] = '\0';
+			if (strncasecmp(request, "json", 4) == 0)
+				format = METRICS_JSON;
+		}
+	}
+
+	out = open_memstream(&buf, &len);
+	if (out == NULL)
+		return;
+	fprint_metrics(out, metrics, format);
+	fclose(out);
+
+	for (sent = 0; sent < len; sent += bytes) {
+		bytes = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+		if (bytes <= 0)
+			break;
+	}
+
+	free(buf);
+}
+
+/* Main logic of the endpoint thread: answer the clients one at a time
+ * until asked to stop */
+static void * metrics_main(void * arg)
+{
+	struct metrics * metrics = (struct metrics *)arg;
+	struct pollfd pfd = {metrics->listen_fd, POLLIN, 0};
+	int fd;
+
+	while (!atomic_load_explicit(&metrics->done, memory_order_acquire)) {
+		if (poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+			continue;
+
+		fd = accept(metrics->listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		metrics_answer(metrics, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Start serving snapshots on a UNIX socket bound to <path>, which is
+ * replaced if it exists. Returns 0 on success and -1 on failure. */
+int metrics_serve(struct metrics * metrics, const char * path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	metrics->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics->listen_fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(metrics->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(metrics->listen_fd, 8) < 0)
+		goto err_close;
+
+	metrics->path = path;
+	if (pthread_create(&metrics->thread, NULL, metrics_main, metrics) != 0)
+		goto err_unlink;
+
+	return 0;
+
+err_unlink:
+	unlink(path);
+	metrics->path = NULL;
+err_close:
+	close(metrics->listen_fd);
+	metrics->listen_fd = -1;
+	return -1;
+}
+
+/* Stop serving snapshots, if needed, and release all the memory */
+void metrics_destroy(struct metrics * metrics)
+{
+	if (metrics->listen_fd >= 0) {
+		atomic_store_explicit(&metrics->done, 1, memory_order_release);
+		pthread_join(metrics->thread, NULL);
+		close(metrics->listen_fd);
+		unlink(metrics->path);
+	}
+
+	free(metrics->workers);
+	free(metrics);
+}
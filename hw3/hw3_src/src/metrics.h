@@ -0,0 +1,116 @@
+/*******************************************************************************
+* Live Metrics (header)
+*
+* Description:
+*     Counters of the requests accepted, rejected and completed by the
+*     servers, and of the time every worker spends busy, kept while they
+*     run. Optionally, a thread serves snapshots of these counters, of the
+*     queue depth and of the latency percentiles (see hist.h) on a local
+*     UNIX socket, so that a monitoring tool can poll them.
+*
+* Notes:
+*     A client connects to the socket and may send "json" or "text"
+*     (the default) followed by a newline; it then receives a snapshot in
+*     that format and the connection is closed.
+*
+*     Every counter has a single writer: the event loop for the accepted
+*     and rejected requests, and each worker for its own. They are plain
+*     relaxed atomics, so that taking a snapshot never blocks or slows
+*     down the threads handling requests.
+*
+*******************************************************************************/
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "queue.h"
+#include "hist.h"
+
+/* How long the endpoint waits for a client, or for its request, before
+ * checking whether it must stop, in milliseconds */
+#define METRICS_POLL_MS 100
+
+/* Format of a snapshot */
+enum metrics_format {
+	METRICS_TEXT = 0,	/* One "key: value" per line */
+	METRICS_JSON,		/* A single JSON object */
+};
+
+/* Counters of one worker, only written by the worker itself */
+struct metrics_worker {
+	_Atomic uint64_t completed;
+	_Atomic uint64_t stolen;
+	_Atomic uint64_t busy_ns;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct metrics {
+	/* Requests accepted and rejected, only written by the event
+	 * loop */
+	_Atomic uint64_t accepted __attribute__((aligned(CACHE_LINE_SIZE)));
+	_Atomic uint64_t rejected;
+
+	/* Time the counters started, in nanoseconds */
+	uint64_t start_ns;
+
+	/* Counters and latency histograms of every worker */
+	int nr_workers;
+	struct metrics_worker * workers;
+	struct latency_hists * latency;
+
+	/* Queues whose depth is reported */
+	struct queue ** queues;
+	int nr_queues;
+
+	/* Endpoint, if serving: socket path and listening socket, and
+	 * scratch space the histograms are merged into */
+	const char * path;
+	int listen_fd;
+	struct latency_hists merged;
+	atomic_int done;
+	pthread_t thread;
+};
+
+/* Allocate the counters of <nr_workers> workers, whose latency
+ * histograms are in the array <latency>, reporting the depth of the
+ * <nr_queues> queues in <queues>. Returns NULL on failure. */
+struct metrics * metrics_create(int nr_workers, struct latency_hists * latency,
+				struct queue ** queues, int nr_queues);
+
+/* Start serving snapshots on a UNIX socket bound to <path>, which is
+ * replaced if it exists. Returns 0 on success and -1 on failure. */
+int metrics_serve(struct metrics * metrics, const char * path);
+
+/* Stop serving snapshots, if needed, and release all the memory */
+void metrics_destroy(struct metrics * metrics);
+
+/* Write a snapshot of all the metrics to <out> in the given format */
+void fprint_metrics(FILE * out, struct metrics * metrics, enum metrics_format format);
+
+/* Count a request accepted by the event loop */
+static inline void metrics_accepted(struct metrics * metrics)
+{
+	atomic_store_explicit(&metrics->accepted,
+			      atomic_load_explicit(&metrics->accepted, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+/* Count a request rejected by the event loop */
+static inline void metrics_rejected(struct metrics * metrics)
+{
+	atomic_store_explicit(&metrics->rejected,
+			      atomic_load_explicit(&metrics->rejected, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+/* Count the request <req> completed by worker <worker>, which it took
+ * from a sibling if <stolen> is set. Must only be called by the
+ * worker itself. */
+void metrics_completed(struct metrics * metrics, int worker,
+		       struct request_meta * req, int stolen);
+
+#endif
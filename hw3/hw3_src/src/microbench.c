@@ -0,0 +1,405 @@
+/*******************************************************************************
+* Microbenchmarks of the Core Structures
+*
+* Description:
+*     Measures, in isolation, the cost of the building blocks the servers
+*     are made of: enqueue and dequeue on the request queue with 1 to N
+*     producer and consumer threads, the overhead and overshoot of the
+*     busy-waiting primitives, the basic time functions, and writing one
+*     log record as text or as a binary trace record.
+*
+* Usage:
+*     <build directory>/microbench [-n <operations>] [-t <threads>] [-p <policy>]
+*
+* Parameters:
+*     operations - Number of operations per measurement (default 1000000)
+*     threads    - Highest number of producers and of consumers; every
+*                  power of two up to it is measured (default 4)
+*     policy     - Policy of the queue: FIFO (default), SJN or EDF
+*
+* Notes:
+*     Times are taken with get_clocks() and reported in TSC cycles per
+*     operation, and in nanoseconds if the TSC could be calibrated. The
+*     busy-wait overshoot is measured with CLOCK_MONOTONIC, so it includes
+*     the cost of one clock_gettime().
+*
+*     With more threads than CPUs, the queue figures mostly measure the
+*     scheduler: compare them at equal thread counts only.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "queue.h"
+#include "log.h"
+#include "trace.h"
+
+#define USAGE_STRING							\
+	"Missing or invalid parameter. Exiting.\n"			\
+	"Usage: %s [-n <operations>] [-t <threads>] [-p <policy>]\n"
+
+/* Defaults of the parameters */
+#define BENCH_DEFAULT_OPS 1000000
+#define BENCH_DEFAULT_THREADS 4
+
+/* Size of the queue under test */
+#define BENCH_QUEUE_SIZE 1024
+
+/* Busy-wait delays measured, in nanoseconds, and the total time spent
+ * on each of them */
+static const nstime_t busywait_delays[] = {0, 1000, 10000, 100000, 1000000};
+#define BENCH_BUSYWAIT_NS (100 * 1000 * 1000)
+
+/* State shared by the threads of one queue measurement */
+struct queue_bench {
+	struct queue * queue;
+	pthread_barrier_t start;
+	struct request_meta req;
+};
+
+/* One producer or consumer thread, and its share of the operations */
+struct queue_thread {
+	struct queue_bench * bench;
+	size_t ops;
+	pthread_t thread;
+};
+
+/* Print a measurement of <cycles> cycles over <ops> operations */
+static void print_cost(const char * name, uint64_t cycles, uint64_t ops)
+{
+	double per_op = (double)cycles / ops;
+
+	if (tsc.usable)
+		printf("%-36s %10.1lf cycles/op %10.1lf ns/op\n", name, per_op,
+		       per_op / tsc.cycles_per_ns);
+	else
+		printf("%-36s %10.1lf cycles/op\n", name, per_op);
+}
+
+/* Main logic of a producer: add its share of requests, retrying while
+ * the queue is full */
+static void * producer_main(void * arg)
+{
+	struct queue_thread * self = (struct queue_thread *)arg;
+	struct request_meta req = self->bench->req;
+	size_t i;
+
+	pthread_barrier_wait(&self->bench->start);
+
+	for (i = 0; i < self->ops; ++i) {
+		req.req_id = i;
+		req.length_ns = i % 1000;
+		while (add_to_queue(req, self->bench->queue) != 0)
+			cpu_relax();
+	}
+
+	return NULL;
+}
+
+/* Main logic of a consumer: take its share of requests */
+static void * consumer_main(void * arg)
+{
+	struct queue_thread * self = (struct queue_thread *)arg;
+	size_t i;
+
+	pthread_barrier_wait(&self->bench->start);
+
+	for (i = 0; i < self->ops; ++i)
+		get_from_queue(self->bench->queue);
+
+	return NULL;
+}
+
+/* Start <count> threads running <fn> that share <ops> operations */
+static void start_threads(struct queue_thread * threads, int count, size_t ops,
+			  struct queue_bench * bench, void * (*fn)(void *))
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		threads[i].bench = bench;
+		threads[i].ops = ops / count + (i == 0 ? ops % count : 0);
+		pthread_create(&threads[i].thread, NULL, fn, &threads[i]);
+	}
+}
+
+/* Measure the single-threaded cost of enqueue and dequeue, a queue
+ * full at a time */
+static void bench_queue_single(enum queue_policy policy, size_t ops)
+{
+	struct request_meta req;
+	struct queue * queue = queue_create(BENCH_QUEUE_SIZE, policy);
+	uint64_t start, end, add_cycles = 0, get_cycles = 0;
+	size_t done, i;
+
+	memset(&req, 0, sizeof(req));
+	req.sent_ns = now_ns() + (nstime_t)3600 * NANO_IN_SEC;
+
+	for (done = 0; done < ops; done += BENCH_QUEUE_SIZE) {
+		get_clocks(start);
+		for (i = 0; i < BENCH_QUEUE_SIZE; ++i) {
+			req.req_id = done + i;
+			req.length_ns = i % 1000;
+			add_to_queue(req, queue);
+		}
+		get_clocks(end);
+		add_cycles += end - start;
+
+		get_clocks(start);
+		for (i = 0; i < BENCH_QUEUE_SIZE; ++i)
+			get_from_queue(queue);
+		get_clocks(end);
+		get_cycles += end - start;
+	}
+
+	print_cost("enqueue, 1 thread", add_cycles, done);
+	print_cost("dequeue, 1 thread", get_cycles, done);
+	queue_destroy(queue);
+}
+
+/* Measure the throughput of the queue with <producers> producers and
+ * <consumers> consumers moving <ops> requests through it */
+static void bench_queue_threads(enum queue_policy policy, size_t ops,
+				int producers, int consumers)
+{
+	struct queue_thread prod[producers], cons[consumers];
+	struct queue_bench bench;
+	uint64_t start, end;
+	char name[64];
+	int i;
+
+	memset(&bench.req, 0, sizeof(bench.req));
+	bench.req.sent_ns = now_ns() + (nstime_t)3600 * NANO_IN_SEC;
+	bench.queue = queue_create(BENCH_QUEUE_SIZE, policy);
+	queue_set_edf(bench.queue, EDF_DEFAULT_SLACK, consumers);
+	pthread_barrier_init(&bench.start, NULL, producers + consumers + 1);
+
+	start_threads(prod, producers, ops, &bench, producer_main);
+	start_threads(cons, consumers, ops, &bench, consumer_main);
+
+	pthread_barrier_wait(&bench.start);
+	get_clocks(start);
+	for (i = 0; i < producers; ++i)
+		pthread_join(prod[i].thread, NULL);
+	for (i = 0; i < consumers; ++i)
+		pthread_join(cons[i].thread, NULL);
+	get_clocks(end);
+
+	snprintf(name, sizeof(name), "enqueue+dequeue, %dP/%dC", producers, consumers);
+	print_cost(name, end - start, ops);
+
+	pthread_barrier_destroy(&bench.start);
+	queue_destroy(bench.queue);
+}
+
+/* Measure the cost of the busy-wait <busywait> for every delay, and how
+ * far past the requested delay it returns */
+static void bench_busywait(const char * path, uint64_t (*busywait)(nstime_t))
+{
+	uint64_t start, end, cycles;
+	nstime_t delay, before, after, over, max_over, sum_over;
+	size_t i, d, iters;
+	char name[64];
+
+	for (d = 0; d < sizeof(busywait_delays) / sizeof(busywait_delays[0]); ++d) {
+		delay = busywait_delays[d];
+		iters = BENCH_BUSYWAIT_NS / (delay > 1000 ? delay : 1000);
+		cycles = sum_over = max_over = 0;
+
+		for (i = 0; i < iters; ++i) {
+			before = now_ns();
+			get_clocks(start);
+			busywait(delay);
+			get_clocks(end);
+			after = now_ns();
+
+			cycles += end - start;
+			over = (after - before > delay ? after - before - delay : 0);
+			sum_over += over;
+			if (over > max_over)
+				max_over = over;
+		}
+
+		snprintf(name, sizeof(name), "busywait %s, %lu ns", path, delay);
+		printf("%-36s %10.1lf cycles/op overshoot mean %lu ns max %lu ns\n",
+		       name, (double)cycles / iters, sum_over / iters, max_over);
+	}
+}
+
+/* Measure the basic time functions */
+static void bench_timelib(size_t ops)
+{
+	struct timespec acc = {0, 0}, step = {0, 999999999};
+	uint64_t start, end, clocks;
+	volatile nstime_t sink;
+	size_t i;
+
+	get_clocks(start);
+	for (i = 0; i < ops; ++i)
+		get_clocks(clocks);
+	get_clocks(end);
+	print_cost("get_clocks", end - start, ops);
+	sink = clocks;
+
+	get_clocks(start);
+	for (i = 0; i < ops; ++i)
+		sink = now_ns();
+	get_clocks(end);
+	print_cost("now_ns (clock_gettime)", end - start, ops);
+
+	if (tsc.usable) {
+		get_clocks(start);
+		for (i = 0; i < ops; ++i)
+			sink = tsc_now_ns();
+		get_clocks(end);
+		print_cost("tsc_now_ns", end - start, ops);
+	}
+
+	get_clocks(start);
+	for (i = 0; i < ops; ++i)
+		timespec_add(&acc, &step);
+	get_clocks(end);
+	print_cost("timespec_add", end - start, ops);
+	(void)sink;
+}
+
+/* Measure formatting one record as a text line and as a binary trace
+ * record, and the whole logger path for both formats */
+static void bench_log(size_t ops)
+{
+	struct trace_record rec;
+	struct request_meta req;
+	struct logger * logger;
+	uint64_t start, end, pushed;
+	FILE * out = fopen("/dev/null", "w");
+	size_t i;
+	int format;
+
+	if (out == NULL) {
+		perror("Unable to open /dev/null");
+		return;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.sent_ns = now_ns();
+	rec.length_ns = 1234567;
+	rec.receipt_ns = rec.sent_ns + 20000;
+	rec.start_ns = rec.receipt_ns + 30000;
+	rec.completion_ns = rec.start_ns + rec.length_ns;
+
+	get_clocks(start);
+	for (i = 0; i < ops; ++i)
+		fprintf(out, "T%d R%ld:" NSTIME_FMT "," NSTIME_FMT "," NSTIME_FMT ","
+			NSTIME_FMT "," NSTIME_FMT "\n", rec.worker, i,
+			NSTIME_ARGS(rec.sent_ns), NSTIME_ARGS(rec.length_ns),
+			NSTIME_ARGS(rec.receipt_ns), NSTIME_ARGS(rec.start_ns),
+			NSTIME_ARGS(rec.completion_ns));
+	fflush(out);
+	get_clocks(end);
+	print_cost("text record (fprintf)", end - start, ops);
+
+	get_clocks(start);
+	for (i = 0; i < ops; ++i) {
+		rec.req_id = i;
+		trace_write(out, &rec);
+	}
+	fflush(out);
+	get_clocks(end);
+	print_cost("binary record (trace_write)", end - start, ops);
+
+	/* The producer only pays for the push, unless the logger thread
+	 * falls behind and the ring fills up */
+	memset(&req, 0, sizeof(req));
+	req.sent_ns = rec.sent_ns;
+	req.length_ns = rec.length_ns;
+	req.receipt_ns = rec.receipt_ns;
+	req.start_ns = rec.start_ns;
+	req.completion_ns = rec.completion_ns;
+
+	for (format = LOG_TEXT; format <= LOG_BINARY; ++format) {
+		logger = log_create(out, format, 1, NULL, 0, QUEUE_DUMP_OFF);
+		if (logger == NULL) {
+			perror("Unable to create logger");
+			break;
+		}
+
+		get_clocks(start);
+		for (i = 0; i < ops; ++i) {
+			req.req_id = i;
+			log_completed(logger, 0, 0, &req);
+		}
+		get_clocks(pushed);
+		log_destroy(logger);
+		get_clocks(end);
+
+		print_cost(format == LOG_TEXT ? "log_completed, text" : "log_completed, binary",
+			   pushed - start, ops);
+		print_cost(format == LOG_TEXT ? "  including the drain, text"
+			   : "  including the drain, binary", end - start, ops);
+	}
+
+	fclose(out);
+}
+
+int main (int argc, char ** argv) {
+	long ops = BENCH_DEFAULT_OPS, threads = BENCH_DEFAULT_THREADS;
+	enum queue_policy policy = QUEUE_FIFO;
+	int opt, retval, p, c;
+
+	while ((opt = getopt(argc, argv, "n:t:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			ops = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			retval = queue_parse_policy(optarg);
+			if (retval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid queue policy: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			policy = retval;
+			break;
+		default:
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (ops <= 0 || threads <= 0) {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	tsc_calibrate();
+	tsc_report(stdout);
+
+	printf("\nQueue (%s, %ld operations)\n", queue_policy_name(policy), ops);
+	bench_queue_single(policy, ops);
+	for (p = 1; p <= threads; p *= 2)
+		for (c = 1; c <= threads; c *= 2)
+			bench_queue_threads(policy, ops, p, c);
+
+	printf("\nTime functions (%ld operations)\n", ops);
+	bench_timelib(ops);
+
+	/* Measure the busy-wait both ways, whichever busywait_ns() picks */
+	printf("\nBusy-waiting\n");
+	if (tsc.usable)
+		bench_busywait("tsc", busywait_tsc_ns);
+	bench_busywait("clock_gettime", busywait_clock_ns);
+
+	printf("\nLogging (%ld records)\n", ops);
+	bench_log(ops);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+/*******************************************************************************
+* Request Node Pool (implementation)
+*
+* Description:
+*     Fixed-size pool of request_meta nodes, allocated once when the queue
+*     is created and recycled for the whole lifetime of the server. Nodes
+*     are handed out and returned through a lock-free free list.
+*
+* Notes:
+*     The head of the free list is a 64-bit word holding a 32-bit tag and
+*     a 32-bit node index, updated with a single compare-and-swap. The
+*     next links are atomics as well, since a thread may read the link of
+*     a node that another thread is popping at the same time; the tag then
+*     makes its compare-and-swap fail.
+*
+*******************************************************************************/
+
+#include "pool.h"
+#include "queue.h"
+
+/* Pack and unpack the head of the free list */
+#define HEAD(tag, idx) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define HEAD_TAG(head) ((uint32_t)((head) >> 32))
+#define HEAD_IDX(head) ((uint32_t)(head))
+
+/* Allocate a pool of <size> nodes. Returns NULL on failure. */
+struct pool * pool_create(size_t size)
+{
+	struct pool * pool;
+	size_t i;
+
+	if (size == 0 || size >= POOL_NIL)
+		return NULL;
+
+	pool = (struct pool *)malloc(sizeof(struct pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->size = size;
+	pool->nodes = (struct request_meta *)
+		aligned_alloc(CACHE_LINE_SIZE,
+			      CACHE_LINE_ROUND(size * sizeof(struct request_meta)));
+	pool->next = (_Atomic uint32_t *)malloc(size * sizeof(_Atomic uint32_t));
+	if (pool->nodes == NULL || pool->next == NULL)
+		goto err_free;
+
+	/* Touch the nodes now, so that they are placed on the NUMA node
+	 * of the thread creating the queue rather than of a worker */
+	memset(pool->nodes, 0, size * sizeof(struct request_meta));
+
+	/* Initially, every node is on the free list, in order */
+	for (i = 0; i < size; ++i)
+		atomic_init(&pool->next[i], (i + 1 < size ? i + 1 : POOL_NIL));
+
+	atomic_init(&pool->head, HEAD(0, 0));
+	atomic_init(&pool->in_use, 0);
+	atomic_init(&pool->peak, 0);
+
+	return pool;
+
+err_free:
+	free(pool->nodes);
+	free(pool->next);
+	free(pool);
+	return NULL;
+}
+
+/* Release all the memory held by the pool */
+void pool_destroy(struct pool * pool)
+{
+	free(pool->nodes);
+	free(pool->next);
+	free(pool);
+}
+
+/* Take a node from the pool. Returns NULL if all the nodes are in
+ * use. */
+struct request_meta * pool_get(struct pool * pool)
+{
+	uint64_t head, new_head;
+	uint32_t idx;
+	size_t in_use, peak;
+
+	head = atomic_load_explicit(&pool->head, memory_order_acquire);
+	do {
+		idx = HEAD_IDX(head);
+		if (idx == POOL_NIL)
+			return NULL;
+
+		new_head = HEAD(HEAD_TAG(head) + 1,
+				atomic_load_explicit(&pool->next[idx], memory_order_relaxed));
+	} while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, new_head,
+							memory_order_acquire,
+							memory_order_acquire));
+
+	/* Only touch the peak when it actually grows */
+	in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+	peak = atomic_load_explicit(&pool->peak, memory_order_relaxed);
+	while (in_use > peak
+	       && !atomic_compare_exchange_weak_explicit(&pool->peak, &peak, in_use,
+							 memory_order_relaxed,
+							 memory_order_relaxed))
+		;
+
+	return &pool->nodes[idx];
+}
+
+/* Return a node obtained with pool_get() to the pool */
+void pool_put(struct pool * pool, struct request_meta * node)
+{
+	uint32_t idx = node - pool->nodes;
+	uint64_t head;
+
+	atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+	head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+	do {
+		atomic_store_explicit(&pool->next[idx], HEAD_IDX(head), memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&pool->head, &head,
+							HEAD(HEAD_TAG(head) + 1, idx),
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+/* Return the highest number of nodes that were ever in use at the
+ * same time */
+size_t pool_peak(struct pool * pool)
+{
+	return atomic_load_explicit(&pool->peak, memory_order_relaxed);
+}
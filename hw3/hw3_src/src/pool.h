@@ -0,0 +1,66 @@
+/*******************************************************************************
+* Request Node Pool (header)
+*
+* Description:
+*     Fixed-size pool of request_meta nodes, allocated once when the queue
+*     is created and recycled for the whole lifetime of the server. Nodes
+*     are handed out and returned through a lock-free free list, so that
+*     any number of producers and consumers can use the pool concurrently
+*     without ever calling malloc() or free() on the request path.
+*
+* Notes:
+*     The free list is a stack of node indices. Its head packs the index
+*     of the top node with a tag that is bumped on every update, so that
+*     a node that is popped and pushed back between our read of the head
+*     and our compare-and-swap (the ABA problem) cannot go unnoticed.
+*
+*******************************************************************************/
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+struct request_meta;
+
+/* Marks the end of the free list */
+#define POOL_NIL UINT32_MAX
+
+struct pool {
+	/* Head of the free list: tag in the upper 32 bits, index of the
+	 * top node (or POOL_NIL) in the lower 32 bits */
+	atomic_uint_least64_t head;
+
+	/* Next free node after each node, only meaningful while the node
+	 * is on the free list */
+	_Atomic uint32_t * next;
+
+	struct request_meta * nodes;
+	size_t size;
+
+	/* Number of nodes currently handed out, and the highest it has
+	 * ever been */
+	atomic_size_t in_use;
+	atomic_size_t peak;
+};
+
+/* Allocate a pool of <size> nodes. Returns NULL on failure. */
+struct pool * pool_create(size_t size);
+
+/* Release all the memory held by the pool */
+void pool_destroy(struct pool * pool);
+
+/* Take a node from the pool. Returns NULL if all the nodes are in
+ * use. */
+struct request_meta * pool_get(struct pool * pool);
+
+/* Return a node obtained with pool_get() to the pool */
+void pool_put(struct pool * pool, struct request_meta * node);
+
+/* Return the highest number of nodes that were ever in use at the
+ * same time */
+size_t pool_peak(struct pool * pool);
+
+#endif
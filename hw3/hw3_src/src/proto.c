@@ -0,0 +1,276 @@
+/*******************************************************************************
+* Compact Wire Protocol (implementation)
+*
+* Description:
+*     Encoding and decoding of the hello and of the request and response
+*     frames of the compact protocol.
+*
+* Notes:
+*     Layout of the hello (all fields little-endian):
+*
+*         offset  size  field
+*         0       4     magic ("HW3P")
+*         4       2     version
+*         6       2     (reserved, zero)
+*
+*     Layout of a request frame:
+*
+*         0       1     type ('Q')
+*         1       1     (reserved, zero)
+*         2       2     count
+*         4       8     base_id
+*         12      8     base_ns
+*         20      12    entry 0: id - base_id (4), sent_ns - base_ns
+*                       (4), length_ns (4)
+*         ...
+*
+*     Layout of a response frame:
+*
+*         0       1     type ('A')
+*         1       1     (reserved, zero)
+*         2       2     count
+*         4       8     base_id
+*         12      5     entry 0: id - base_id (4), ack (1)
+*         ...
+*
+*******************************************************************************/
+
+#include <endian.h>
+
+#include "proto.h"
+
+/* Store a 16-bit value at <buf> in little-endian order */
+static inline void put_le16(uint8_t * buf, uint16_t val)
+{
+	val = htole16(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+/* Store a 32-bit value at <buf> in little-endian order */
+static inline void put_le32(uint8_t * buf, uint32_t val)
+{
+	val = htole32(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+/* Store a 64-bit value at <buf> in little-endian order */
+static inline void put_le64(uint8_t * buf, uint64_t val)
+{
+	val = htole64(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+/* Load a 16-bit little-endian value from <buf> */
+static inline uint16_t get_le16(const uint8_t * buf)
+{
+	uint16_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le16toh(val);
+}
+
+/* Load a 32-bit little-endian value from <buf> */
+static inline uint32_t get_le32(const uint8_t * buf)
+{
+	uint32_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le32toh(val);
+}
+
+/* Load a 64-bit little-endian value from <buf> */
+static inline uint64_t get_le64(const uint8_t * buf)
+{
+	uint64_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le64toh(val);
+}
+
+/* Write a hello for <version> into <buf>. Returns its size. */
+size_t proto_write_hello(uint8_t * buf, int version)
+{
+	memcpy(&buf[0], PROTO_MAGIC, 4);
+	put_le16(&buf[4], version);
+	put_le16(&buf[6], 0);
+
+	return PROTO_HELLO_SIZE;
+}
+
+/* Read the hello at <buf>, which holds at least PROTO_HELLO_SIZE bytes.
+ * Returns its version, or -1 if the bytes are not a valid hello. */
+int proto_read_hello(const uint8_t * buf)
+{
+	if (memcmp(&buf[0], PROTO_MAGIC, 4) != 0 || get_le16(&buf[4]) == PROTO_LEGACY)
+		return -1;
+
+	return get_le16(&buf[4]);
+}
+
+/* Return the size of the frame of type <type> starting at <buf>, of
+ * which <len> bytes are available: 0 if the header is incomplete, -1
+ * if the header is not valid. */
+ssize_t proto_frame_size(const uint8_t * buf, size_t len, enum proto_frame_type type)
+{
+	size_t count;
+
+	if (len < PROTO_FRAME_HEADER_SIZE)
+		return 0;
+
+	count = get_le16(&buf[2]);
+	if (buf[0] != type || count == 0 || count > PROTO_MAX_BATCH)
+		return -1;
+
+	if (type == PROTO_FRAME_REQUESTS)
+		return PROTO_FRAME_HEADER_SIZE + PROTO_REQ_BASE_SIZE
+			+ count * PROTO_REQ_ENTRY_SIZE;
+
+	return PROTO_FRAME_HEADER_SIZE + PROTO_RESP_BASE_SIZE
+		+ count * PROTO_RESP_ENTRY_SIZE;
+}
+
+/* Encode as many of the <count> requests in <reqs> as fit in one frame
+ * into <buf>, which must hold PROTO_MAX_REQ_FRAME bytes. The number of
+ * requests encoded is stored in *encoded (0 if the first request
+ * cannot be encoded at all). Returns the size of the frame. */
+size_t proto_encode_requests(uint8_t * buf, const struct proto_request * reqs,
+			     size_t count, size_t * encoded)
+{
+	uint64_t min_id, max_id;
+	nstime_t min_ns, max_ns;
+	size_t i, n;
+	uint8_t * entry;
+
+	if (count > PROTO_MAX_BATCH)
+		count = PROTO_MAX_BATCH;
+
+	/* Take requests as long as their offsets fit on 32 bits */
+	min_id = max_id = (count > 0 ? reqs[0].req_id : 0);
+	min_ns = max_ns = (count > 0 ? reqs[0].sent_ns : 0);
+	for (n = 0; n < count; ++n) {
+		if (reqs[n].length_ns > UINT32_MAX)
+			break;
+		if (reqs[n].req_id < min_id)
+			min_id = reqs[n].req_id;
+		if (reqs[n].req_id > max_id)
+			max_id = reqs[n].req_id;
+		if (reqs[n].sent_ns < min_ns)
+			min_ns = reqs[n].sent_ns;
+		if (reqs[n].sent_ns > max_ns)
+			max_ns = reqs[n].sent_ns;
+		if (max_id - min_id > UINT32_MAX || max_ns - min_ns > UINT32_MAX)
+			break;
+	}
+
+	/* Recompute the bases without the request that did not fit */
+	*encoded = n;
+	if (n == 0)
+		return 0;
+
+	min_id = reqs[0].req_id;
+	min_ns = reqs[0].sent_ns;
+	for (i = 1; i < n; ++i) {
+		if (reqs[i].req_id < min_id)
+			min_id = reqs[i].req_id;
+		if (reqs[i].sent_ns < min_ns)
+			min_ns = reqs[i].sent_ns;
+	}
+
+	buf[0] = PROTO_FRAME_REQUESTS;
+	buf[1] = 0;
+	put_le16(&buf[2], n);
+	put_le64(&buf[4], min_id);
+	put_le64(&buf[12], min_ns);
+
+	entry = &buf[PROTO_FRAME_HEADER_SIZE + PROTO_REQ_BASE_SIZE];
+	for (i = 0; i < n; ++i, entry += PROTO_REQ_ENTRY_SIZE) {
+		put_le32(&entry[0], reqs[i].req_id - min_id);
+		put_le32(&entry[4], reqs[i].sent_ns - min_ns);
+		put_le32(&entry[8], reqs[i].length_ns);
+	}
+
+	return PROTO_FRAME_HEADER_SIZE + PROTO_REQ_BASE_SIZE + n * PROTO_REQ_ENTRY_SIZE;
+}
+
+/* Decode the complete request frame at <buf> into <reqs>, which must
+ * hold PROTO_MAX_BATCH requests. Returns the number of requests. */
+size_t proto_decode_requests(const uint8_t * buf, struct proto_request * reqs)
+{
+	size_t i, count = get_le16(&buf[2]);
+	uint64_t base_id = get_le64(&buf[4]);
+	nstime_t base_ns = get_le64(&buf[12]);
+	const uint8_t * entry = &buf[PROTO_FRAME_HEADER_SIZE + PROTO_REQ_BASE_SIZE];
+
+	for (i = 0; i < count; ++i, entry += PROTO_REQ_ENTRY_SIZE) {
+		reqs[i].req_id = base_id + get_le32(&entry[0]);
+		reqs[i].sent_ns = base_ns + get_le32(&entry[4]);
+		reqs[i].length_ns = get_le32(&entry[8]);
+	}
+
+	return count;
+}
+
+/* Encode as many of the <count> responses in <resps> as fit in one
+ * frame into <buf>, which must hold PROTO_MAX_RESP_FRAME bytes. The
+ * number of responses encoded is stored in *encoded. Returns the size
+ * of the frame. */
+size_t proto_encode_responses(uint8_t * buf, const struct response * resps,
+			      size_t count, size_t * encoded)
+{
+	uint64_t min_id, max_id;
+	size_t i, n;
+	uint8_t * entry;
+
+	if (count > PROTO_MAX_BATCH)
+		count = PROTO_MAX_BATCH;
+
+	/* Take responses as long as their ID offsets fit on 32 bits */
+	min_id = max_id = (count > 0 ? resps[0].req_id : 0);
+	for (n = 0; n < count; ++n) {
+		if (resps[n].req_id < min_id)
+			min_id = resps[n].req_id;
+		if (resps[n].req_id > max_id)
+			max_id = resps[n].req_id;
+		if (max_id - min_id > UINT32_MAX)
+			break;
+	}
+
+	/* Recompute the base without the response that did not fit */
+	*encoded = n;
+	if (n == 0)
+		return 0;
+
+	min_id = resps[0].req_id;
+	for (i = 1; i < n; ++i)
+		if (resps[i].req_id < min_id)
+			min_id = resps[i].req_id;
+
+	buf[0] = PROTO_FRAME_RESPONSES;
+	buf[1] = 0;
+	put_le16(&buf[2], n);
+	put_le64(&buf[4], min_id);
+
+	entry = &buf[PROTO_FRAME_HEADER_SIZE + PROTO_RESP_BASE_SIZE];
+	for (i = 0; i < n; ++i, entry += PROTO_RESP_ENTRY_SIZE) {
+		put_le32(&entry[0], resps[i].req_id - min_id);
+		entry[4] = resps[i].ack;
+	}
+
+	return PROTO_FRAME_HEADER_SIZE + PROTO_RESP_BASE_SIZE + n * PROTO_RESP_ENTRY_SIZE;
+}
+
+/* Decode the complete response frame at <buf> into <resps>, which must
+ * hold PROTO_MAX_BATCH responses. Returns the number of responses. */
+size_t proto_decode_responses(const uint8_t * buf, struct response * resps)
+{
+	size_t i, count = get_le16(&buf[2]);
+	uint64_t base_id = get_le64(&buf[4]);
+	const uint8_t * entry = &buf[PROTO_FRAME_HEADER_SIZE + PROTO_RESP_BASE_SIZE];
+
+	for (i = 0; i < count; ++i, entry += PROTO_RESP_ENTRY_SIZE) {
+		resps[i].req_id = base_id + get_le32(&entry[0]);
+		resps[i].ack = entry[4];
+	}
+
+	return count;
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+* Compact Wire Protocol (header)
+*
+* Description:
+*     Versioned, packed encoding of the requests and responses exchanged by
+*     the clients and the servers. A client that speaks it starts with a
+*     hello carrying the highest version it supports, the server answers
+*     with the version that will be used, and from then on both sides send
+*     frames of up to PROTO_MAX_BATCH requests or responses each.
+*
+*     Clients that start right away with a raw struct request (see
+*     common.h) keep being served with raw structs as before: this is the
+*     legacy protocol, version 0.
+*
+* Notes:
+*     Every field is little-endian and written at an explicit offset, like
+*     in the binary trace, so that the encoding does not depend on the
+*     host byte order nor on compiler padding.
+*
+*     Within a frame, the IDs and send times of the requests are stored as
+*     32-bit offsets from a base carried by the frame header, and request
+*     lengths on 32 bits, i.e. up to about 4.29 seconds. A request takes
+*     12 bytes instead of 40, and a response 5 bytes instead of 16, plus
+*     the share of its frame header.
+*
+*     A legacy client is told apart from a hello by the first 4 bytes it
+*     sends, i.e. by the low half of the ID of its first request, which
+*     would have to be 0x50335748 to be mistaken for PROTO_MAGIC.
+*
+*******************************************************************************/
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/* Identifies a hello, followed by a version of the protocol */
+#define PROTO_MAGIC "HW3P"
+
+/* Versions of the protocol: raw structs, and packed frames */
+#define PROTO_UNKNOWN (-1)
+#define PROTO_LEGACY 0
+#define PROTO_VERSION 1
+
+/* Size of a hello, in both directions */
+#define PROTO_HELLO_SIZE 8
+
+/* Every frame starts with a type, a reserved byte and a count */
+#define PROTO_FRAME_HEADER_SIZE 4
+
+/* A request frame then holds a base ID and a base send time, followed
+ * by <count> entries */
+#define PROTO_REQ_BASE_SIZE 16
+#define PROTO_REQ_ENTRY_SIZE 12
+
+/* A response frame then holds a base ID, followed by <count> entries */
+#define PROTO_RESP_BASE_SIZE 8
+#define PROTO_RESP_ENTRY_SIZE 5
+
+/* Maximum number of requests or responses in a frame */
+#define PROTO_MAX_BATCH 64
+
+/* Size of the largest request and response frames */
+#define PROTO_MAX_REQ_FRAME						\
+	(PROTO_FRAME_HEADER_SIZE + PROTO_REQ_BASE_SIZE + PROTO_MAX_BATCH * PROTO_REQ_ENTRY_SIZE)
+#define PROTO_MAX_RESP_FRAME						\
+	(PROTO_FRAME_HEADER_SIZE + PROTO_RESP_BASE_SIZE + PROTO_MAX_BATCH * PROTO_RESP_ENTRY_SIZE)
+
+/* Type of a frame */
+enum proto_frame_type {
+	PROTO_FRAME_REQUESTS = 'Q',
+	PROTO_FRAME_RESPONSES = 'A',
+};
+
+/* A request as carried by the protocol, times in nanoseconds */
+struct proto_request {
+	uint64_t req_id;
+	nstime_t sent_ns;
+	nstime_t length_ns;
+};
+
+/* Write a hello for <version> into <buf>. Returns its size. */
+size_t proto_write_hello(uint8_t * buf, int version);
+
+/* Read the hello at <buf>, which holds at least PROTO_HELLO_SIZE bytes.
+ * Returns its version, or -1 if the bytes are not a valid hello. */
+int proto_read_hello(const uint8_t * buf);
+
+/* Return the size of the frame of type <type> starting at <buf>, of
+ * which <len> bytes are available: 0 if the header is incomplete, -1
+ * if the header is not valid. */
+ssize_t proto_frame_size(const uint8_t * buf, size_t len, enum proto_frame_type type);
+
+/* Encode as many of the <count> requests in <reqs> as fit in one frame
+ * into <buf>, which must hold PROTO_MAX_REQ_FRAME bytes. The number of
+ * requests encoded is stored in *encoded (0 if the first request
+ * cannot be encoded at all). Returns the size of the frame. */
+size_t proto_encode_requests(uint8_t * buf, const struct proto_request * reqs,
+			     size_t count, size_t * encoded);
+
+/* Decode the complete request frame at <buf> into <reqs>, which must
+ * hold PROTO_MAX_BATCH requests. Returns the number of requests. */
+size_t proto_decode_requests(const uint8_t * buf, struct proto_request * reqs);
+
+/* Encode as many of the <count> responses in <resps> as fit in one
+ * frame into <buf>, which must hold PROTO_MAX_RESP_FRAME bytes. The
+ * number of responses encoded is stored in *encoded. Returns the size
+ * of the frame. */
+size_t proto_encode_responses(uint8_t * buf, const struct response * resps,
+			      size_t count, size_t * encoded);
+
+/* Decode the complete response frame at <buf> into <resps>, which must
+ * hold PROTO_MAX_BATCH responses. Returns the number of responses. */
+size_t proto_decode_responses(const uint8_t * buf, struct response * resps);
+
+#endif
@@ -0,0 +1,903 @@
+/*******************************************************************************
+* Shared Request Queue (implementation)
+*
+* Description:
+*     Bounded queue of pending requests shared between the thread that
+*     receives requests from the client and the worker thread(s) that
+*     process them. The FIFO policy uses a fixed-size lock-free ring, so
+*     that multiple producers and consumers can operate on it concurrently.
+*     The other policies use a binary min-heap protected by a semaphore.
+*     Under EDF, a request is rejected on arrival if the work in service
+*     and the work queued ahead of it no longer allow it to complete by
+*     its deadline.
+*
+* Notes:
+*     Each slot of the ring carries a sequence number. A producer at
+*     position pos may fill the slot when its sequence is pos, and
+*     publishes it by setting the sequence to pos + 1. A consumer at
+*     position pos may take the slot when its sequence is pos + 1, and
+*     frees it for the next lap by setting it to pos + max_size.
+*
+*     The queue also keeps the statistics reported by queue_snapshot()
+*     up to date as requests come and go, so that they can be read at
+*     any time without walking (or locking) the queue.
+*
+*******************************************************************************/
+
+#include <strings.h>
+
+#include "queue.h"
+
+/* Names of the queue policies, as accepted on the command line */
+static const char * policy_names[] = {
+	[QUEUE_FIFO] = "FIFO",
+	[QUEUE_SJN] = "SJN",
+	[QUEUE_EDF] = "EDF",
+};
+
+/* Names of the queue dump modes, as accepted on the command line */
+static const char * dump_names[] = {
+	[QUEUE_DUMP_FULL] = "full",
+	[QUEUE_DUMP_SUMMARY] = "summary",
+	[QUEUE_DUMP_OFF] = "off",
+	[QUEUE_DUMP_SPLIT] = "split",
+};
+
+/* Allocate a new queue that can hold up to queue_size requests and
+ * serves them according to <policy>. Returns NULL on failure. */
+struct queue * queue_create(size_t queue_size, enum queue_policy policy)
+{
+	struct queue * the_queue;
+	size_t i;
+
+	if (queue_size == 0)
+		return NULL;
+
+	the_queue = (struct queue *)aligned_alloc(CACHE_LINE_SIZE,
+						    CACHE_LINE_ROUND(sizeof(struct queue)));
+	if (the_queue == NULL)
+		return NULL;
+
+	memset(the_queue, 0, sizeof(struct queue));
+	atomic_init(&the_queue->enqueue_pos, 0);
+	atomic_init(&the_queue->dequeue_pos, 0);
+	atomic_init(&the_queue->work_ns, 0);
+	atomic_init(&the_queue->peak, 0);
+	queue_spin_init(&the_queue->spin, 0);
+	atomic_init(&the_queue->oldest_ns, 0);
+	the_queue->max_size = queue_size;
+	the_queue->policy = policy;
+	the_queue->slack = EDF_DEFAULT_SLACK;
+	the_queue->consumers = 1;
+
+	/* All the slots (or heap entries) are allocated once here, so
+	 * that no memory management is needed on the enqueue/dequeue
+	 * path. */
+	if (policy == QUEUE_FIFO) {
+		the_queue->slots = (struct queue_slot *)
+			aligned_alloc(CACHE_LINE_SIZE,
+				      CACHE_LINE_ROUND(queue_size * sizeof(struct queue_slot)));
+		if (the_queue->slots == NULL)
+			goto err_free_queue;
+
+		for (i = 0; i < queue_size; ++i)
+			atomic_init(&the_queue->slots[i].seq, i);
+	} else {
+		the_queue->heap = (struct heap_entry *)
+			malloc(queue_size * sizeof(struct heap_entry));
+		the_queue->heap_scratch = (struct heap_dump_entry *)
+			malloc(queue_size * sizeof(struct heap_dump_entry));
+		the_queue->pool = pool_create(queue_size);
+		the_queue->busy_until_ns = (nstime_t *)calloc(1, sizeof(nstime_t));
+		if (the_queue->heap == NULL || the_queue->heap_scratch == NULL
+		    || the_queue->pool == NULL || the_queue->busy_until_ns == NULL)
+			goto err_free_slots;
+
+		if (sem_init(&the_queue->lock, 0, 1) < 0)
+			goto err_free_slots;
+		if (sem_init(&the_queue->dump_lock, 0, 1) < 0)
+			goto err_free_slots;
+	}
+
+	if (sem_init(&the_queue->notify, 0, 0) < 0)
+		goto err_free_slots;
+
+	return the_queue;
+
+err_free_slots:
+	free(the_queue->slots);
+	free(the_queue->heap);
+	free(the_queue->heap_scratch);
+	free(the_queue->busy_until_ns);
+	if (the_queue->pool)
+		pool_destroy(the_queue->pool);
+err_free_queue:
+	free(the_queue);
+	return NULL;
+}
+
+/* Translate a policy name (e.g. "FIFO", "SJN") into a queue
+ * policy. Returns -1 if the name is not recognized. */
+int queue_parse_policy(const char * name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); ++i)
+		if (strcasecmp(name, policy_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Return the name of a queue policy */
+const char * queue_policy_name(enum queue_policy policy)
+{
+	return policy_names[policy];
+}
+
+/* Configure the EDF policy. The deadline of a request is its
+ * req_timestamp plus <slack> times its req_length; <consumers> is the
+ * number of workers serving the queue. */
+void queue_set_edf(struct queue * the_queue, double slack, int consumers)
+{
+	nstime_t * busy;
+
+	if (consumers < 1)
+		consumers = 1;
+
+	the_queue->slack = slack;
+
+	/* Track when each consumer is done; if that cannot be done, keep
+	 * modeling the previous number of consumers */
+	if (the_queue->policy != QUEUE_FIFO) {
+		busy = (nstime_t *)calloc(consumers, sizeof(nstime_t));
+		if (busy == NULL)
+			return;
+		free(the_queue->busy_until_ns);
+		the_queue->busy_until_ns = busy;
+	}
+	the_queue->consumers = consumers;
+}
+
+/* Set how long consumers spin waiting for a request before going to
+ * sleep, in nanoseconds. 0 (the default) disables spinning, and
+ * QUEUE_SPIN_AUTO derives the budget from the inter-arrival times. */
+void queue_set_spin(struct queue * the_queue, long spin_ns)
+{
+	queue_spin_init(&the_queue->spin, spin_ns);
+}
+
+/* Initialize <spin> with a spin budget of <spin_ns> (see
+ * queue_set_spin()) */
+void queue_spin_init(struct queue_spin * spin, long spin_ns)
+{
+	if (spin_ns > QUEUE_SPIN_MAX_NS)
+		spin_ns = QUEUE_SPIN_MAX_NS;
+
+	spin->spin_ns = spin_ns;
+	atomic_init(&spin->last_arrival_ns, 0);
+	atomic_init(&spin->arrival_avg_ns, 0);
+}
+
+/* Translate a spin budget given on the command line, either a number
+ * of microseconds or "auto", into <spin_ns>. Returns 0 on success and
+ * -1 if the budget is not valid or exceeds QUEUE_SPIN_MAX_NS. */
+int queue_parse_spin(const char * arg, long * spin_ns)
+{
+	char * end;
+	long spin_us;
+
+	if (strcasecmp(arg, "auto") == 0) {
+		*spin_ns = QUEUE_SPIN_AUTO;
+		return 0;
+	}
+
+	spin_us = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || spin_us < 0
+	    || spin_us > QUEUE_SPIN_MAX_NS / 1000)
+		return -1;
+
+	*spin_ns = spin_us * 1000;
+	return 0;
+}
+
+/* Release all the memory held by the queue */
+void queue_destroy(struct queue * the_queue)
+{
+	sem_destroy(&the_queue->notify);
+	if (the_queue->policy != QUEUE_FIFO) {
+		sem_destroy(&the_queue->lock);
+		sem_destroy(&the_queue->dump_lock);
+	}
+
+	free(the_queue->slots);
+	free(the_queue->heap);
+	free(the_queue->heap_scratch);
+	free(the_queue->busy_until_ns);
+	if (the_queue->pool)
+		pool_destroy(the_queue->pool);
+	free(the_queue);
+}
+
+/* Return the number of requests currently in the queue. The value
+ * is only a snapshot if producers or consumers are active. */
+size_t queue_length(struct queue * the_queue)
+{
+	size_t head, tail;
+
+	if (the_queue->policy != QUEUE_FIFO)
+		return __atomic_load_n(&the_queue->heap_size, __ATOMIC_RELAXED);
+
+	head = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_acquire);
+	tail = atomic_load_explicit(&the_queue->enqueue_pos, memory_order_acquire);
+	return (tail > head ? tail - head : 0);
+}
+
+/* Return the total length of the requests currently in the queue, in
+ * nanoseconds */
+uint64_t queue_work(struct queue * the_queue)
+{
+	return atomic_load_explicit(&the_queue->work_ns, memory_order_relaxed);
+}
+
+/* Return the receipt time of the request at the head of the ring, or
+ * 0 if there is none. The slot is read optimistically, like in
+ * fdump_queue_status(), and the read is retried if a consumer took it
+ * meanwhile. */
+static uint64_t ring_oldest(struct queue * the_queue)
+{
+	struct queue_slot * slot;
+	nstime_t receipt;
+	size_t pos;
+
+	for (;;) {
+		pos = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_acquire);
+		slot = &the_queue->slots[pos % the_queue->max_size];
+
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+			return 0;
+
+		receipt = slot->req_meta.receipt_ns;
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == pos + 1)
+			return receipt;
+	}
+}
+
+/* Return the highest number of requests that were ever in the queue
+ * at the same time */
+size_t queue_peak(struct queue * the_queue)
+{
+	if (the_queue->policy != QUEUE_FIFO)
+		return pool_peak(the_queue->pool);
+
+	return atomic_load_explicit(&the_queue->peak, memory_order_relaxed);
+}
+
+/* Fill <snap> with the length of the queue, the total length of the
+ * queued requests and the receipt time of the oldest one, without
+ * taking any lock. The fields are read separately, so they may be
+ * slightly out of sync if producers or consumers are active. */
+void queue_snapshot(struct queue * the_queue, struct queue_snapshot * snap)
+{
+	snap->length = queue_length(the_queue);
+	snap->work_ns = atomic_load_explicit(&the_queue->work_ns, memory_order_relaxed);
+
+	if (the_queue->policy == QUEUE_FIFO)
+		snap->oldest_ns = ring_oldest(the_queue);
+	else
+		snap->oldest_ns = atomic_load_explicit(&the_queue->oldest_ns,
+						       memory_order_relaxed);
+}
+
+/* Return nonzero if heap entry a must be served before heap entry b */
+static inline int heap_before(struct heap_entry * a, struct heap_entry * b)
+{
+	return (a->key < b->key || (a->key == b->key && a->seq < b->seq));
+}
+
+/* Compare two heap dump entries in service order, for qsort() */
+static int heap_dump_cmp(const void * a, const void * b)
+{
+	const struct heap_dump_entry * x = a, * y = b;
+
+	if (x->key < y->key || (x->key == y->key && x->seq < y->seq))
+		return -1;
+	if (y->key < x->key || (y->key == x->key && y->seq < x->seq))
+		return 1;
+	return 0;
+}
+
+/* Compute the priority key of a request under the queue policy */
+static uint64_t heap_key(struct queue * the_queue, struct request_meta * req_meta)
+{
+	switch (the_queue->policy) {
+	case QUEUE_EDF:
+		return req_meta->sent_ns
+			+ (uint64_t)(the_queue->slack * req_meta->length_ns);
+	case QUEUE_SJN:
+	default:
+		return req_meta->length_ns;
+	}
+}
+
+/* Return the consumer expected to be done first with the request it
+ * took from the heap. Must be called with the heap locked. */
+static int heap_first_free(struct queue * the_queue)
+{
+	int i, first = 0;
+
+	for (i = 1; i < the_queue->consumers; ++i)
+		if (the_queue->busy_until_ns[i] < the_queue->busy_until_ns[first])
+			first = i;
+
+	return first;
+}
+
+/* Add to *work the total length of the requests in the subtree at
+ * <pos> that will be served before a request with priority <key>.
+ * Thanks to the heap property, subtrees rooted at a later key are
+ * skipped entirely, and the walk stops as soon as *work exceeds
+ * <budget>: it visits at most the entries ahead of <key> that fit in
+ * the budget. Returns nonzero if the budget was exceeded. */
+static int heap_work_before(struct queue * the_queue, size_t pos, uint64_t key,
+			    uint64_t budget, uint64_t * work)
+{
+	struct heap_entry * entry;
+
+	if (pos >= the_queue->heap_size)
+		return 0;
+
+	entry = &the_queue->heap[pos];
+	if (entry->key > key)
+		return 0;
+
+	*work += entry->req->length_ns;
+	if (*work > budget)
+		return 1;
+
+	return heap_work_before(the_queue, 2 * pos + 1, key, budget, work)
+		|| heap_work_before(the_queue, 2 * pos + 2, key, budget, work);
+}
+
+/* EDF admission test: return nonzero if a request with deadline <key>
+ * cannot complete in time once the work in service and the work queued
+ * ahead of it are done. Must be called with the heap locked. */
+static int edf_misses_deadline(struct queue * the_queue, struct heap_entry * entry)
+{
+	uint64_t now = now_ns(), start, budget, work = 0;
+
+	/* The request can start once the first consumer is done with
+	 * what it has in service */
+	start = the_queue->busy_until_ns[heap_first_free(the_queue)];
+	if (start < now)
+		start = now;
+	if (start + entry->req->length_ns > entry->key)
+		return 1;
+
+	/* Then the consumers share the work queued ahead of it */
+	budget = (entry->key - start - entry->req->length_ns) * the_queue->consumers;
+	return heap_work_before(the_queue, 0, entry->key, budget, &work);
+}
+
+/* Insert a request into the heap. Returns 0 on success, 1 if the
+ * queue is full, and 2 if the request would miss its deadline. */
+static int heap_add(struct request_meta * to_add, struct queue * the_queue)
+{
+	struct heap_entry entry, * heap = the_queue->heap;
+	size_t pos, parent;
+	int retval = 0;
+
+	/* Copy the request into a node before taking the lock. There
+	 * are as many nodes as heap entries, so running out of nodes
+	 * means that the queue is full. */
+	entry.req = pool_get(the_queue->pool);
+	if (entry.req == NULL)
+		return 1;
+
+	*entry.req = *to_add;
+	entry.key = heap_key(the_queue, to_add);
+
+	sem_wait(&the_queue->lock);
+
+	if (the_queue->heap_size == the_queue->max_size) {
+		retval = 1;
+		goto out;
+	}
+
+	if (the_queue->policy == QUEUE_EDF && edf_misses_deadline(the_queue, &entry)) {
+		retval = 2;
+		goto out;
+	}
+
+	entry.seq = the_queue->heap_seq++;
+
+	/* A new entry is only the oldest if the heap was empty */
+	if (the_queue->heap_size == 0) {
+		the_queue->oldest_seq = entry.seq;
+		atomic_store_explicit(&the_queue->oldest_ns,
+				      to_add->receipt_ns,
+				      memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&the_queue->work_ns,
+				  to_add->length_ns,
+				  memory_order_relaxed);
+
+	/* Sift the new entry up from the bottom of the heap */
+	pos = the_queue->heap_size;
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!heap_before(&entry, &heap[parent]))
+			break;
+		heap[pos] = heap[parent];
+		pos = parent;
+	}
+	heap[pos] = entry;
+	__atomic_store_n(&the_queue->heap_size, the_queue->heap_size + 1,
+			 __ATOMIC_RELAXED);
+
+	sem_post(&the_queue->notify);
+out:
+	sem_post(&the_queue->lock);
+
+	if (retval != 0)
+		pool_put(the_queue->pool, entry.req);
+	return retval;
+}
+
+/* Find the new oldest entry after the oldest one left the heap. This
+ * walks the whole heap, but only runs when the oldest entry is the one
+ * being served. Must be called with the heap locked. */
+static void heap_update_oldest(struct queue * the_queue)
+{
+	struct heap_entry * oldest = NULL;
+	size_t i;
+
+	for (i = 0; i < the_queue->heap_size; ++i)
+		if (oldest == NULL || the_queue->heap[i].seq < oldest->seq)
+			oldest = &the_queue->heap[i];
+
+	if (oldest == NULL) {
+		atomic_store_explicit(&the_queue->oldest_ns, 0, memory_order_relaxed);
+		return;
+	}
+
+	the_queue->oldest_seq = oldest->seq;
+	atomic_store_explicit(&the_queue->oldest_ns,
+			      oldest->req->receipt_ns,
+			      memory_order_relaxed);
+}
+
+/* Remove the request at the top of the heap into <out>. Returns 0 on
+ * success and -1 if the heap is empty. */
+static int heap_get(struct queue * the_queue, struct request_meta * out)
+{
+	struct heap_entry * heap = the_queue->heap, last;
+	size_t pos, child, size;
+	uint64_t top_seq, now;
+	nstime_t * busy;
+	int retval = 0;
+
+	sem_wait(&the_queue->lock);
+
+	if (the_queue->heap_size == 0) {
+		retval = -1;
+		goto out;
+	}
+
+	/* Copy the request out and recycle its node. The node goes back
+	 * to the pool before the lock is released, so that a producer
+	 * never finds the pool empty while the heap has room. */
+	*out = *heap[0].req;
+	pool_put(the_queue->pool, heap[0].req);
+	top_seq = heap[0].seq;
+	size = the_queue->heap_size - 1;
+	last = heap[size];
+
+	/* Sift the last entry down from the top of the heap */
+	pos = 0;
+	while ((child = 2 * pos + 1) < size) {
+		if (child + 1 < size && heap_before(&heap[child + 1], &heap[child]))
+			child++;
+		if (!heap_before(&heap[child], &last))
+			break;
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = last;
+	__atomic_store_n(&the_queue->heap_size, size, __ATOMIC_RELAXED);
+
+	atomic_fetch_sub_explicit(&the_queue->work_ns,
+				  out->length_ns,
+				  memory_order_relaxed);
+
+	/* The request is now in service, on the consumer that was done
+	 * first with its previous request */
+	busy = &the_queue->busy_until_ns[heap_first_free(the_queue)];
+	now = now_ns();
+	*busy = (*busy > now ? *busy : now) + out->length_ns;
+
+	if (top_seq == the_queue->oldest_seq)
+		heap_update_oldest(the_queue);
+
+out:
+	sem_post(&the_queue->lock);
+	return retval;
+}
+
+/* Account for the arrival of <req> in the auto-tuned spin budget, by
+ * folding its receipt time into the average inter-arrival time.
+ * Concurrent producers may lose an update, which only makes the
+ * average a little less precise. */
+void queue_spin_note_arrival(struct queue_spin * spin, struct request_meta * req)
+{
+	uint64_t now, last, gap, avg;
+
+	if (spin->spin_ns != QUEUE_SPIN_AUTO)
+		return;
+
+	now = req->receipt_ns;
+	last = atomic_exchange_explicit(&spin->last_arrival_ns, now, memory_order_relaxed);
+	if (last == 0 || now <= last)
+		return;
+
+	gap = now - last;
+	avg = atomic_load_explicit(&spin->arrival_avg_ns, memory_order_relaxed);
+	avg = (avg == 0 ? gap : avg - (avg >> QUEUE_ARRIVAL_SHIFT) + (gap >> QUEUE_ARRIVAL_SHIFT));
+	atomic_store_explicit(&spin->arrival_avg_ns, avg, memory_order_relaxed);
+}
+
+/* Return how long a consumer should spin before sleeping, in
+ * nanoseconds */
+static inline uint64_t queue_spin_budget(struct queue_spin * spin)
+{
+	uint64_t avg;
+
+	if (spin->spin_ns != QUEUE_SPIN_AUTO)
+		return spin->spin_ns;
+
+	/* Only spin if the next request is likely to arrive soon */
+	avg = atomic_load_explicit(&spin->arrival_avg_ns, memory_order_relaxed);
+	if (avg == 0 || 2 * avg > QUEUE_SPIN_MAX_NS)
+		return 0;
+
+	return 2 * avg;
+}
+
+/* Take one unit from <sem>, spinning for up to the budget of <spin>
+ * before sleeping. While the semaphore is zero, sem_trywait() only
+ * reads it, so spinning on it does not bounce its cache line. */
+void queue_spin_wait(struct queue_spin * spin, sem_t * sem)
+{
+	nstime_t deadline;
+	uint64_t budget;
+	unsigned int i;
+
+	budget = queue_spin_budget(spin);
+	if (budget == 0) {
+		sem_wait(sem);
+		return;
+	}
+
+	deadline = now_ns() + budget;
+
+	do {
+		/* Only look at the clock every few iterations */
+		for (i = 0; i < 64; ++i) {
+			if (sem_trywait(sem) == 0)
+				return;
+			cpu_relax();
+		}
+	} while (now_ns() < deadline);
+
+	sem_wait(sem);
+}
+
+/* Record the length of the ring after a producer claimed position
+ * <pos>, if it is the highest so far. The peak is only written when it
+ * grows, so this is a single relaxed load most of the time. */
+static inline void ring_update_peak(struct queue * the_queue, size_t pos)
+{
+	size_t head, length, peak;
+
+	head = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_relaxed);
+	length = (pos + 1 > head ? pos + 1 - head : 0);
+	if (length > the_queue->max_size)
+		length = the_queue->max_size;
+
+	peak = atomic_load_explicit(&the_queue->peak, memory_order_relaxed);
+	while (length > peak
+	       && !atomic_compare_exchange_weak_explicit(&the_queue->peak, &peak, length,
+							 memory_order_relaxed,
+							 memory_order_relaxed))
+		;
+}
+
+/* Add a new request <to_add> to the shared queue <the_queue>.
+ * Returns 0 on success, 1 if the queue is full, and 2 if (under EDF)
+ * the request can no longer meet its deadline. */
+int add_to_queue(struct request_meta to_add, struct queue * the_queue)
+{
+	struct queue_slot * slot;
+	size_t pos;
+	intptr_t diff;
+
+	queue_spin_note_arrival(&the_queue->spin, &to_add);
+
+	if (the_queue->policy != QUEUE_FIFO)
+		return heap_add(&to_add, the_queue);
+
+	pos = atomic_load_explicit(&the_queue->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		slot = &the_queue->slots[pos % the_queue->max_size];
+		diff = (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire)
+			- (intptr_t)pos;
+
+		if (diff == 0) {
+			/* The slot is free in this lap: try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&the_queue->enqueue_pos,
+								  &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* The slot still holds a request from the previous
+			 * lap: the queue is full. */
+			return 1;
+		} else {
+			/* Another producer got here first */
+			pos = atomic_load_explicit(&the_queue->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	/* Fill the slot and publish it to the consumers */
+	slot->req_meta = to_add;
+	ring_update_peak(the_queue, pos);
+	atomic_fetch_add_explicit(&the_queue->work_ns,
+				  to_add.length_ns,
+				  memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	/* Signal that there is one more request to pick up */
+	sem_post(&the_queue->notify);
+	return 0;
+}
+
+/* Remove the next request from the queue into <out>, once a unit of
+ * notify has been taken for it. Returns 0 on success and -1 if the
+ * queue turned out to be empty, i.e. we were only woken up to
+ * terminate. */
+static int queue_take(struct queue * the_queue, struct request_meta * out)
+{
+	struct queue_slot * slot;
+	size_t pos;
+	intptr_t diff;
+
+	if (the_queue->policy != QUEUE_FIFO)
+		return heap_get(the_queue, out);
+
+	pos = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_relaxed);
+	for (;;) {
+		slot = &the_queue->slots[pos % the_queue->max_size];
+		diff = (intptr_t)atomic_load_explicit(&slot->seq, memory_order_acquire)
+			- (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			/* The slot holds a published request: try to claim it */
+			if (atomic_compare_exchange_weak_explicit(&the_queue->dequeue_pos,
+								  &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* Nothing published here yet. If no producer has
+			 * claimed the slot either, the queue is empty and we
+			 * have only been woken up to terminate. */
+			if (atomic_load_explicit(&the_queue->enqueue_pos,
+						 memory_order_acquire) == pos)
+				return -1;
+
+			/* Otherwise, a producer is about to publish it */
+			cpu_relax();
+			pos = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_relaxed);
+		} else {
+			/* Another consumer got here first */
+			pos = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_relaxed);
+		}
+	}
+
+	/* Copy the request out and hand the slot to the next lap */
+	*out = slot->req_meta;
+	atomic_store_explicit(&slot->seq, pos + the_queue->max_size, memory_order_release);
+	atomic_fetch_sub_explicit(&the_queue->work_ns,
+				  out->length_ns,
+				  memory_order_relaxed);
+
+	return 0;
+}
+
+/* Get the next request from the shared queue <the_queue>. Blocks
+ * (after spinning, if enabled) until a request is available or until
+ * queue_wakeup() is called, in which case a zeroed request is
+ * returned. */
+struct request_meta get_from_queue(struct queue * the_queue)
+{
+	struct request_meta retval;
+
+	/* Wait for a producer to tell us that there is work */
+	queue_spin_wait(&the_queue->spin, &the_queue->notify);
+
+	if (queue_take(the_queue, &retval) < 0)
+		memset(&retval, 0, sizeof(retval));
+
+	return retval;
+}
+
+/* Get the next request from <the_queue> if there is one, without
+ * blocking. Returns 0 on success and -1 if the queue is empty. */
+int queue_try_get(struct queue * the_queue, struct request_meta * out)
+{
+	if (sem_trywait(&the_queue->notify) < 0)
+		return -1;
+
+	return queue_take(the_queue, out);
+}
+
+/* Wake up <count> consumers blocked in get_from_queue() */
+void queue_wakeup(struct queue * the_queue, int count)
+{
+	while (count-- > 0)
+		sem_post(&the_queue->notify);
+}
+
+/* Copy the heap into the scratch array and sort it in service order.
+ * Only the copy is done with the heap locked. Must be called with
+ * dump_lock held. Returns the number of entries. */
+static size_t heap_sort_scratch(struct queue * the_queue)
+{
+	size_t i, size;
+
+	sem_wait(&the_queue->lock);
+	size = the_queue->heap_size;
+	for (i = 0; i < size; ++i) {
+		the_queue->heap_scratch[i].key = the_queue->heap[i].key;
+		the_queue->heap_scratch[i].seq = the_queue->heap[i].seq;
+		the_queue->heap_scratch[i].req_id = the_queue->heap[i].req->req_id;
+	}
+	sem_post(&the_queue->lock);
+
+	qsort(the_queue->heap_scratch, size, sizeof(struct heap_dump_entry), heap_dump_cmp);
+	return size;
+}
+
+/* Read the ID of the request in the ring slot at position <pos> into
+ * <req_id>. The slot is read optimistically: returns 0 only if it held
+ * a published request whose sequence number did not change while we
+ * were reading it. */
+static int ring_read_id(struct queue * the_queue, size_t pos, uint64_t * req_id)
+{
+	struct queue_slot * slot = &the_queue->slots[pos % the_queue->max_size];
+
+	/* Skip slots that are not (or no longer) published */
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+		return -1;
+
+	*req_id = slot->req_meta.req_id;
+	atomic_thread_fence(memory_order_acquire);
+
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != pos + 1)
+		return -1;
+
+	return 0;
+}
+
+/* Print the heap in service order. The entries are copied out and
+ * sorted, since the heap itself is only partially ordered. Only the
+ * copy is done with the heap locked, so that producers and consumers
+ * are not held up while we print. */
+static int heap_dump(FILE * out, struct queue * the_queue, int first)
+{
+	size_t i, size;
+
+	sem_wait(&the_queue->dump_lock);
+	size = heap_sort_scratch(the_queue);
+
+	for (i = 0; i < size; ++i) {
+		fprintf(out, "%sR%ld", (first ? "" : ","), the_queue->heap_scratch[i].req_id);
+		first = 0;
+	}
+
+	sem_post(&the_queue->dump_lock);
+	return first;
+}
+
+/* Print the IDs of the requests currently in the queue, in the order
+ * in which they will be served. Ring slots are read optimistically: an
+ * entry is only printed if its sequence number did not change while we
+ * were reading it. */
+void dump_queue_status(struct queue * the_queue)
+{
+	fdump_queue_status(stdout, the_queue);
+}
+
+/* Same as dump_queue_status(), but print to <out> */
+void fdump_queue_status(FILE * out, struct queue * the_queue)
+{
+	fprintf(out, "Q:[");
+	fdump_queue_ids(out, the_queue, 1);
+	fprintf(out, "]\n");
+}
+
+/* Print the IDs of the requests in the queue, in service order and
+ * separated by commas, without the surrounding Q:[...]. <first> tells
+ * whether nothing has been printed on the line yet; the updated value
+ * is returned, so that several queues can be printed in a row. */
+int fdump_queue_ids(FILE * out, struct queue * the_queue, int first)
+{
+	size_t pos, head, tail;
+	uint64_t req_id;
+
+	if (the_queue->policy != QUEUE_FIFO)
+		return heap_dump(out, the_queue, first);
+
+	head = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_acquire);
+	tail = atomic_load_explicit(&the_queue->enqueue_pos, memory_order_acquire);
+
+	for (pos = head; pos < tail; ++pos) {
+		if (ring_read_id(the_queue, pos, &req_id) < 0)
+			continue;
+
+		fprintf(out, "%sR%ld", (first ? "" : ","), req_id);
+		first = 0;
+	}
+
+	return first;
+}
+
+/* Copy the IDs of the requests in the queue, in service order, into
+ * <ids>, which must hold max_size IDs. Returns the number of IDs. */
+size_t queue_copy_ids(struct queue * the_queue, uint64_t * ids)
+{
+	size_t pos, head, tail, i, count = 0;
+
+	if (the_queue->policy != QUEUE_FIFO) {
+		sem_wait(&the_queue->dump_lock);
+		count = heap_sort_scratch(the_queue);
+		for (i = 0; i < count; ++i)
+			ids[i] = the_queue->heap_scratch[i].req_id;
+		sem_post(&the_queue->dump_lock);
+		return count;
+	}
+
+	head = atomic_load_explicit(&the_queue->dequeue_pos, memory_order_acquire);
+	tail = atomic_load_explicit(&the_queue->enqueue_pos, memory_order_acquire);
+
+	for (pos = head; pos < tail && count < the_queue->max_size; ++pos)
+		if (ring_read_id(the_queue, pos, &ids[count]) == 0)
+			count++;
+
+	return count;
+}
+
+/* Translate a queue dump mode ("full", "summary", "off" or "split")
+ * into a queue_dump value. Returns -1 if the name is not recognized. */
+int queue_parse_dump(const char * name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(dump_names) / sizeof(dump_names[0]); ++i)
+		if (strcasecmp(name, dump_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Print a queue snapshot as a one-line summary: length, queued work
+ * and receipt time of the oldest request */
+void fdump_queue_snapshot(FILE * out, struct queue_snapshot * snap)
+{
+	fprintf(out, "Q:%lu,%lf,%lf\n", snap->length,
+		(double)snap->work_ns / NANO_IN_SEC,
+		(double)snap->oldest_ns / NANO_IN_SEC);
+}
@@ -0,0 +1,293 @@
+/*******************************************************************************
+* Shared Request Queue (header)
+*
+* Description:
+*     Bounded queue of pending requests shared between the thread that
+*     receives requests from the client and the worker thread(s) that
+*     process them. The order in which requests are served depends on the
+*     queue policy: FIFO uses a fixed-size lock-free ring, so that multiple
+*     producers and consumers can operate on it concurrently, while SJN
+*     and EDF keep a binary min-heap keyed on the request length and on
+*     the request deadline, respectively.
+*
+* Notes:
+*     The queue is sized once at initialization time and never allocates
+*     memory afterwards: the ring slots hold the requests themselves, and
+*     the heap entries point into a pool of request nodes (see pool.h).
+*     Consumers block on a semaphore while the queue is empty. Optionally,
+*     they first spin for a short while, since a request that shows up
+*     during the spin is picked up without a futex wake-up.
+*
+*     Under EDF, a request is admitted if it can still complete by its
+*     deadline once the first consumer is done with the request it has in
+*     service, and the consumers are done with the queued requests with an
+*     earlier deadline. Finding those costs one visit per queued request
+*     ahead of the new one, and stops early once the deadline is out of
+*     reach.
+*
+*******************************************************************************/
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#include "common.h"
+#include "pool.h"
+
+/* Size of a cache line. Used to keep the producer and consumer
+ * positions of the queue from sharing a line. */
+#define CACHE_LINE_SIZE 64
+
+/* Round <size> up to a whole number of cache lines, as aligned_alloc()
+ * requires of the sizes it is given */
+#define CACHE_LINE_ROUND(size)						\
+	((((size) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE)
+
+/* Order in which queued requests are served */
+enum queue_policy {
+	QUEUE_FIFO = 0,		/* First In, First Out */
+	QUEUE_SJN,		/* Shortest Job Next, by req_length */
+	QUEUE_EDF,		/* Earliest Deadline First */
+};
+
+/* What the request log prints about the queue after every completion */
+enum queue_dump {
+	QUEUE_DUMP_FULL = 0,	/* IDs of all the queued requests */
+	QUEUE_DUMP_SUMMARY,	/* Length, queued work and oldest request */
+	QUEUE_DUMP_OFF,		/* Nothing */
+	QUEUE_DUMP_SPLIT,	/* IDs of the requests of each queue, one
+				 * line per queue */
+};
+
+/* Default deadline of a request under EDF, as a multiple of its
+ * length added to the time it was sent. */
+#define EDF_DEFAULT_SLACK 5.0
+
+/* Pass as the spin budget to queue_set_spin() to have it derived from
+ * the recent inter-arrival times */
+#define QUEUE_SPIN_AUTO (-1)
+
+/* Upper bound on the time a consumer spins before sleeping, in
+ * nanoseconds. With auto tuning, consumers spin for twice the average
+ * inter-arrival time, and do not spin at all if that exceeds this. */
+#define QUEUE_SPIN_MAX_NS 50000
+
+/* Weight of a new sample in the average inter-arrival time, as a
+ * power of two (1/8) */
+#define QUEUE_ARRIVAL_SHIFT 3
+
+struct connection;
+
+/* A request along with the timestamps collected by the server while
+ * handling it, and the connection it must be answered on. The fields
+ * of the struct request received on the wire are converted once, on
+ * receipt, and all the times are in nanoseconds (see nstime_t). */
+struct request_meta {
+	uint64_t req_id;
+	nstime_t sent_ns;	/* req_timestamp of the request */
+	nstime_t length_ns;	/* req_length of the request */
+	nstime_t receipt_ns;
+	nstime_t start_ns;
+	nstime_t completion_ns;
+	struct connection * conn;
+};
+
+/* Spinning state of the consumers of a semaphore: how long they spin
+ * before sleeping, in nanoseconds, or QUEUE_SPIN_AUTO. With auto
+ * tuning, producers keep a moving average of the time between the
+ * receipt of two requests. */
+struct queue_spin {
+	long spin_ns;
+	atomic_uint_least64_t last_arrival_ns;
+	atomic_uint_least64_t arrival_avg_ns;
+};
+
+/* Summary of the queue contents, taken in constant time. work_ns is
+ * the total length of the queued requests, and oldest_ns the time at
+ * which the oldest of them was received (0 if the queue is empty). */
+struct queue_snapshot {
+	size_t length;
+	uint64_t work_ns;
+	uint64_t oldest_ns;
+};
+
+/* One slot of the ring. The sequence number tells producers and
+ * consumers whether the slot is free or holds a published request
+ * for the current lap around the ring. */
+struct queue_slot {
+	atomic_size_t seq;
+	struct request_meta req_meta;
+};
+
+/* One entry of the priority queue. Entries with a smaller key are
+ * served first; the sequence number breaks ties in arrival order. The
+ * request itself lives in a pool node, so that sifting entries up and
+ * down the heap only moves a few words. */
+struct heap_entry {
+	uint64_t key;
+	uint64_t seq;
+	struct request_meta * req;
+};
+
+/* Copy of a heap entry used to print the heap in service order */
+struct heap_dump_entry {
+	uint64_t key;
+	uint64_t seq;
+	uint64_t req_id;
+};
+
+/* Bounded multi-producer/multi-consumer ring buffer. The enqueue and
+ * dequeue positions only ever grow; a position maps to slot (pos %
+ * max_size). No lock is needed to add or remove requests. With a
+ * non-FIFO policy, the ring is unused and requests go to the heap. */
+struct queue {
+	atomic_size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	atomic_size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct queue_slot * slots __attribute__((aligned(CACHE_LINE_SIZE)));
+	size_t max_size;
+	enum queue_policy policy;
+
+	/* Total length of the queued requests, in nanoseconds. Kept on
+	 * its own line, since producers and consumers all update it. */
+	atomic_uint_least64_t work_ns __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/* Highest number of requests ever in the ring at the same time */
+	atomic_size_t peak;
+
+	/* Counts the requests that consumers have yet to pick up */
+	sem_t notify __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/* Binary heap used by the non-FIFO policies, protected by lock,
+	 * and the pool its entries point into. The scratch array,
+	 * protected by dump_lock, is used to print the heap in service
+	 * order without holding lock. */
+	sem_t lock;
+	sem_t dump_lock;
+	struct heap_entry * heap;
+	struct heap_dump_entry * heap_scratch;
+	struct pool * pool;
+	size_t heap_size;
+	uint64_t heap_seq;
+
+	/* Oldest request in the heap: its sequence number, protected by
+	 * lock, and its receipt time, readable without the lock */
+	uint64_t oldest_seq;
+	atomic_uint_least64_t oldest_ns;
+
+	/* EDF parameters: deadline slack and number of consumers that
+	 * drain the queue in parallel */
+	double slack;
+	int consumers;
+
+	/* Estimate of when each consumer will be done with the request
+	 * it took from the heap, one entry per consumer. Protected by
+	 * lock. */
+	nstime_t * busy_until_ns;
+
+	/* How long consumers spin before sleeping on notify */
+	struct queue_spin spin;
+};
+
+/* Allocate a new queue that can hold up to queue_size requests and
+ * serves them according to <policy>. Returns NULL on failure. */
+struct queue * queue_create(size_t queue_size, enum queue_policy policy);
+
+/* Translate a policy name (e.g. "FIFO", "SJN") into a queue
+ * policy. Returns -1 if the name is not recognized. */
+int queue_parse_policy(const char * name);
+
+/* Return the name of a queue policy */
+const char * queue_policy_name(enum queue_policy policy);
+
+/* Configure the EDF policy. The deadline of a request is its
+ * req_timestamp plus <slack> times its req_length; <consumers> is the
+ * number of workers serving the queue. */
+void queue_set_edf(struct queue * the_queue, double slack, int consumers);
+
+/* Set how long consumers spin waiting for a request before going to
+ * sleep, in nanoseconds. 0 (the default) disables spinning, and
+ * QUEUE_SPIN_AUTO derives the budget from the inter-arrival times. */
+void queue_set_spin(struct queue * the_queue, long spin_ns);
+
+/* Initialize <spin> with a spin budget of <spin_ns> (see
+ * queue_set_spin()) */
+void queue_spin_init(struct queue_spin * spin, long spin_ns);
+
+/* Account for the arrival of <req> in the auto-tuned spin budget */
+void queue_spin_note_arrival(struct queue_spin * spin, struct request_meta * req);
+
+/* Take one unit from <sem>, spinning for up to the budget of <spin>
+ * before sleeping */
+void queue_spin_wait(struct queue_spin * spin, sem_t * sem);
+
+/* Translate a spin budget given on the command line, either a number
+ * of microseconds or "auto", into <spin_ns>. Returns 0 on success and
+ * -1 if the budget is not valid or exceeds QUEUE_SPIN_MAX_NS. */
+int queue_parse_spin(const char * arg, long * spin_ns);
+
+/* Release all the memory held by the queue */
+void queue_destroy(struct queue * the_queue);
+
+/* Return the number of requests currently in the queue */
+size_t queue_length(struct queue * the_queue);
+
+/* Return the total length of the requests currently in the queue, in
+ * nanoseconds */
+uint64_t queue_work(struct queue * the_queue);
+
+/* Return the highest number of requests that were ever in the queue
+ * at the same time */
+size_t queue_peak(struct queue * the_queue);
+
+/* Fill <snap> with the length of the queue, the total length of the
+ * queued requests and the receipt time of the oldest one, without
+ * taking any lock. The fields are read separately, so they may be
+ * slightly out of sync if producers or consumers are active. */
+void queue_snapshot(struct queue * the_queue, struct queue_snapshot * snap);
+
+/* Add a new request <to_add> to the shared queue <the_queue>.
+ * Returns 0 on success, 1 if the queue is full, and 2 if (under EDF)
+ * the request can no longer meet its deadline. */
+int add_to_queue(struct request_meta to_add, struct queue * the_queue);
+
+/* Get the next request from the shared queue <the_queue>. Blocks
+ * (after spinning, if enabled) until a request is available or until
+ * queue_wakeup() is called, in which case a zeroed request is
+ * returned. */
+struct request_meta get_from_queue(struct queue * the_queue);
+
+/* Get the next request from <the_queue> if there is one, without
+ * blocking. Returns 0 on success and -1 if the queue is empty. */
+int queue_try_get(struct queue * the_queue, struct request_meta * out);
+
+/* Wake up <count> consumers blocked in get_from_queue() */
+void queue_wakeup(struct queue * the_queue, int count);
+
+/* Print the IDs of the requests currently in the queue, in the
+ * order in which they will be served */
+void dump_queue_status(struct queue * the_queue);
+
+/* Same as dump_queue_status(), but print to <out> */
+void fdump_queue_status(FILE * out, struct queue * the_queue);
+
+/* Print the IDs of the requests in the queue, in service order and
+ * separated by commas, without the surrounding Q:[...]. <first> tells
+ * whether nothing has been printed on the line yet; the updated value
+ * is returned, so that several queues can be printed in a row. */
+int fdump_queue_ids(FILE * out, struct queue * the_queue, int first);
+
+/* Copy the IDs of the requests in the queue, in service order, into
+ * <ids>, which must hold max_size IDs. Returns the number of IDs. */
+size_t queue_copy_ids(struct queue * the_queue, uint64_t * ids);
+
+/* Translate a queue dump mode ("full", "summary", "off" or "split")
+ * into a queue_dump value. Returns -1 if the name is not recognized. */
+int queue_parse_dump(const char * name);
+
+/* Print a queue snapshot as a one-line summary: length, queued work
+ * and receipt time of the oldest request */
+void fdump_queue_snapshot(FILE * out, struct queue_snapshot * snap);
+
+#endif
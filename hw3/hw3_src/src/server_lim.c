@@ -6,13 +6,46 @@
  *     First Out (FIFO) order. The server binds to the specified port number
  *     provided as a parameter upon launch. It launches a secondary thread to
  *     process incoming requests and allows to specify a maximum queue size.
+ *     Any number of clients can be connected at the same time; their
+ *     requests all go to the same queue.
  *
  * Usage:
- *     <build directory>/server -q <queue_size> <port_number>
+ *     <build directory>/server -q <queue_size> [-p <policy>] [-s <slack>] [-b <batch>] [-t <delay>] [-l <log format>] [-o <log file>] [-d <queue dump>] [-a <spin>] [-c <cpus>] [-S <stack>] [-H] [-i <interval>] [-m <metrics>] <port_number>
  *
  * Parameters:
  *     port_number - The port number to bind the server to.
  *     queue_size  - The maximum number of queued requests
+ *     policy      - The order in which queued requests are served: FIFO
+ *                   (default), SJN (shortest job next) or EDF (earliest
+ *                   deadline first)
+ *     slack       - Under EDF, deadline of a request as a multiple of its
+ *                   length past the time it was sent (default 5)
+ *     batch       - Number of responses sent together (default 1, i.e.
+ *                   no batching)
+ *     delay       - Maximum time a batched response may wait, in
+ *                   microseconds (default 1000)
+ *     log format  - Format of the request log: text (default) or binary
+ *                   (compact trace, see trace_conv)
+ *     log file    - File the request log is written to (default: stdout)
+ *     queue dump  - What the text log prints about the queue after each
+ *                   request: full (default, all the queued IDs), summary
+ *                   (length, queued work, oldest receipt time) or off
+ *     spin        - How long an idle worker spins before sleeping, in
+ *                   microseconds (default 0, at most 50), or auto to
+ *                   derive it from the inter-arrival times
+ *     cpus        - CPUs to pin the threads to, e.g. 0-3,6: the first for
+ *                   the event loop, the others for the worker (default:
+ *                   no pinning)
+ *     stack       - Size of the stack of the worker thread, in KB
+ *                   (default 64)
+ *     -H          - Back the stack of the worker thread with huge pages
+ *     interval    - How often to print the percentiles of the response
+ *                   time, queueing delay and service time, in seconds
+ *                   (default 0: only at shutdown)
+ *     metrics     - Path of a UNIX socket serving snapshots of the live
+ *                   metrics (queue depth, rejections, throughput, worker
+ *                   utilization, latency percentiles) on request, in text
+ *                   or, if the client sends "json", in JSON
  *
  * Author:
  *     Renato Mancuso
@@ -28,6 +61,7 @@
  *     server. The server relies on a FIFO mechanism to handle requests, thus
  *     guaranteeing the order of processing. If the queue is full at the time a
  *     new request is received, the request is rejected with a negative ack.
+ *     The queue is a fixed-size lock-free ring allocated once at startup.
  *
  *******************************************************************************/
 
@@ -35,361 +69,321 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <sched.h>
 #include <signal.h>
 
-/* Needed for wait(...) */
-#include <sys/types.h>
-#include <sys/wait.h>
-
-/* Needed for semaphores */
-#include <semaphore.h>
-
 /* Include struct definitions and other libraries that need to be
  * included by both client and server */
 #include "common.h"
 
-#define BACKLOG_COUNT 100
-#define USAGE_STRING                \
-	"Missing parameter. Exiting.\n" \
-	"Usage: %s -q <queue size> <port_number>\n"
+/* Shared request queue between this thread and the worker */
+#include "queue.h"
 
-/* 4KB of stack for the worker thread */
-#define STACK_SIZE (4096)
+/* Event loop serving all the client connections */
+#include "conn.h"
 
-/* START - Variables needed to protect the shared queue. DO NOT TOUCH */
-sem_t *queue_mutex;
-sem_t *queue_notify;
-/* END - Variables needed to protect the shared queue. DO NOT TOUCH */
+/* Log of the requests, written out by a separate thread */
+#include "log.h"
 
-struct request_meta
-{
-	struct request request;
-	struct timespec receipt_timestamp;
-	struct timespec start_timestamp;
-	struct timespec completion_timestamp;
-};
+/* Pinning of the threads to CPUs */
+#include "affinity.h"
 
-struct Node
-{
-	struct request_meta req_meta;
-	struct Node *next;
-};
+/* Creation and join of the worker thread */
+#include "thread.h"
 
-struct queue
-{
-	/* IMPLEMENT ME */
-	struct Node *front;
-	struct Node *rear;
-	int curr_size;
-	int max_size;
-};
+/* Latency histograms and live metrics kept by the worker */
+#include "hist.h"
+#include "metrics.h"
+
+#define BACKLOG_COUNT 100
+#define USAGE_STRING                \
+	"Missing parameter. Exiting.\n" \
+	"Usage: %s -q <queue size> [-p <policy>] [-s <slack>] [-b <batch>] [-t <delay>] [-l <log format>] [-o <log file>] [-d <queue dump>] [-a <spin>] [-c <cpus>] [-S <stack>] [-H] [-i <interval>] [-m <metrics>] <port_number>\n"
 
 struct connection_params
 {
 	size_t queue_size;
+	enum queue_policy policy;
+	double slack;
+	size_t batch;
+	long batch_delay;
+	enum log_format log_format;
+	enum queue_dump queue_dump;
+	long spin_ns;
+	const char *log_file;
+	struct cpu_placement placement;
+	struct thread_attr thread_attr;
+	double stats_interval;
+	const char *stats_sock;
 };
 
+/* Ring of the logger used by the worker and by the event loop */
+#define LOG_WORKER 0
+#define LOG_EVENT_LOOP 1
+
 struct worker_params
 {
-	int conn_socket;
 	int worker_done;
 	struct queue *the_queue;
-};
-
-/* Helper function to perform queue initialization */
-void queue_init(struct queue *the_queue, size_t queue_size)
-{
-	/* IMPLEMENT ME !! */
-
-	/* Initialize the queue */
-	the_queue->front = NULL;
-	the_queue->rear = NULL;
-	the_queue->curr_size = 0;
-	the_queue->max_size = queue_size;
-}
+	struct logger *logger;
+	struct metrics *metrics;
 
-/* Check if the queue is full*/
-int is_queue_full(struct queue *the_queue)
-{
-	if (the_queue->curr_size == the_queue->max_size)
-	{
-		return 1;
-	}
-	return 0;
-}
-
-/* Add a new request <request> to the shared queue <the_queue> */
-int add_to_queue(struct request_meta to_add, struct queue *the_queue)
-{
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	struct Node *newNode = (struct Node *)malloc(sizeof(struct Node));
-	newNode->req_meta = to_add;
-	newNode->next = NULL;
-
-	/* Make sure that the queue is not full */
-	if (is_queue_full(the_queue))
-	{
-		/* What to do in case of a full queue */
-		/* DO NOT RETURN DIRECTLY HERE */
-		retval = 1;
-	}
-	else
-	{
-		/* If all good, add the item in the queue */
-		/* IMPLEMENT ME !!*/
-		if (the_queue->front == NULL && the_queue->rear == NULL)
-		{
-			the_queue->front = newNode;
-			the_queue->rear = newNode;
-		}
-		else
-		{
-			the_queue->rear->next = newNode;
-			the_queue->rear = newNode;
-		}
-		the_queue->curr_size++;
-
-		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-		sem_post(queue_notify);
-	}
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
-}
-
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue *the_queue)
-{
-	struct request_meta retval;
-	// retval.request.req_id = -1; // Assume req_id is signed, -1 represents an empty queue
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	if (the_queue->front == NULL)
-	{
-		// handle appropriately, perhaps by returning an error request or empty request.
-		goto OUTRO;
-	}
-	struct Node *current = the_queue->front;
-	retval = current->req_meta;
-	the_queue->front = current->next;
+	/* CPU the worker is pinned to, or AFFINITY_NONE */
+	int cpu;
 
-	if (the_queue->front == NULL)
-	{
-		// If front is NULL, then the queue is empty, so rear should also be NULL
-		the_queue->rear = NULL;
-	}
-	free(current);
-	the_queue->curr_size--;
-
-OUTRO:
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
-}
+	/* The worker thread itself */
+	struct thread thread;
+};
 
-void dump_queue_status(struct queue *the_queue)
+/* State passed to handle_request() by the event loop */
+struct handler_params
 {
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-	printf("Q:[");
-	struct Node *current = the_queue->front;
-	while (current != NULL)
-	{
-		printf("R%llu", current->req_meta.request.req_id);
-		if (current->next != NULL)
-			printf(",");
-		current = current->next;
-	}
-	printf("]\n");
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-}
+	struct queue *the_queue;
+	struct logger *logger;
+	struct metrics *metrics;
+};
 
 /* Main logic of the worker thread */
 int worker_main(void *arg)
 {
-	struct timespec now;
 	struct worker_params *params = (struct worker_params *)arg;
 
+	/* Stay on our own CPU from now on, if we were given one */
+	if (affinity_pin_self(params->cpu) < 0)
+		perror("Unable to pin worker thread");
+
 	/* Print the first alive message. */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
+	printf("[#WORKER#] " NSTIME_FMT " Worker Thread Alive!\n", NSTIME_ARGS(now_ns()));
 
 	/* Okay, now execute the main logic. */
 	while (!params->worker_done)
 	{
-		/* IMPLEMENT ME !! Main worker logic. */
 		struct request_meta req_meta;
 		struct response resp;
+
+		/* About to go idle: don't hold on to batched responses */
+		if (queue_length(params->the_queue) == 0)
+			conn_flush_pending();
+
 		req_meta = get_from_queue(params->the_queue);
-		// if (req_meta.request.req_id == -1)
-		// {
-		// 	// If the queue is empty, then we should just continue
-		// 	continue;
-		// }
-
-		clock_gettime(CLOCK_MONOTONIC, &req_meta.start_timestamp);
-		busywait_timespec(req_meta.request.req_length);
-		clock_gettime(CLOCK_MONOTONIC, &req_meta.completion_timestamp);
-
-		resp.req_id = req_meta.request.req_id;
-		send(params->conn_socket, &resp, sizeof(struct response), 0);
-
-		printf("R%ld:%lf,%lf,%lf,%lf,%lf\n", req_meta.request.req_id,
-			   TSPEC_TO_DOUBLE(req_meta.request.req_timestamp),
-			   TSPEC_TO_DOUBLE(req_meta.request.req_length),
-			   TSPEC_TO_DOUBLE(req_meta.receipt_timestamp),
-			   TSPEC_TO_DOUBLE(req_meta.start_timestamp),
-			   TSPEC_TO_DOUBLE(req_meta.completion_timestamp));
-
-		dump_queue_status(params->the_queue);
+
+		/* We might have been woken up only to terminate */
+		if (params->worker_done)
+			break;
+
+		req_meta.start_ns = now_ns();
+		busywait_ns(req_meta.length_ns);
+		req_meta.completion_ns = now_ns();
+
+		/* Answer on the connection the request came from */
+		resp.req_id = req_meta.req_id;
+		resp.ack = RESP_COMPLETED;
+		conn_send_response(req_meta.conn, &resp);
+		conn_put(req_meta.conn);
+
+		metrics_completed(params->metrics, 0, &req_meta, 0);
+
+		/* Leave the printing (and the queue dump) to the logger */
+		log_completed(params->logger, LOG_WORKER, -1, &req_meta);
 	}
 
 	return EXIT_SUCCESS;
 }
 
-/* This function will start the worker thread wrapping around the
- * clone() system call*/
-int start_worker(void *params, void *worker_stack)
+/* This function will start the worker thread, on a stack allocated
+ * as described by <attr>. Returns the thread ID of the worker, or -1
+ * on failure. */
+int start_worker(struct worker_params *params, struct thread_attr *attr)
 {
-	int retval;
-
-	/* Throw an error if no stack was passed. */
-	if (worker_stack == NULL)
+	if (thread_create(&params->thread, attr, worker_main, params) < 0)
 		return -1;
 
-	retval = clone(worker_main, worker_stack + STACK_SIZE,
-				   CLONE_THREAD | CLONE_VM | CLONE_SIGHAND,
-				   params);
+	return thread_id(&params->thread);
+}
 
-	return retval;
+/* Wait for the worker thread to exit and release its stack */
+void join_worker(struct worker_params *params)
+{
+	thread_join(&params->thread);
 }
 
-/* Variable used to control termination of the worker thread */
-int worker_done = 0;
+/* Called by the event loop for every request received from any of
+ * the clients: attempt to enqueue the request, or reject it right away
+ * on the connection it came from. */
+void handle_request(struct request_meta *req, void *arg)
+{
+	struct handler_params *params = (struct handler_params *)arg;
+	nstime_t reject_ns;
+	struct response resp;
+
+	if (add_to_queue(*req, params->the_queue) == 0)
+	{
+		metrics_accepted(params->metrics);
+		return;
+	}
 
-/* Main function to handle connection with the client. This function
- * takes in input conn_socket and returns only when the connection
- * with the client is interrupted. */
-void handle_connection(int conn_socket, struct connection_params conn_params)
+	metrics_rejected(params->metrics);
+
+	reject_ns = now_ns();
+	resp.req_id = req->req_id;
+	resp.ack = RESP_REJECTED;
+	conn_send_response(req->conn, &resp);
+	conn_put(req->conn);
+
+	log_rejected(params->logger, LOG_EVENT_LOOP, req, reject_ns);
+}
+
+/* Main function to handle connections with the clients. This function
+ * takes in input the listening socket and returns only when all the
+ * clients that connected to the server have disconnected. */
+void handle_connections(int listen_socket, struct connection_params conn_params)
 {
-	struct request_meta *req;
 	struct queue *the_queue;
-	size_t in_bytes;
-
-	/* The connection with the client is alive here. Let's get
-	 * ready to start the worker thread. */
-	void *worker_stack = malloc(STACK_SIZE);
+	struct logger *logger;
+	struct handler_params handler;
+	struct latency_hists latency;
+	struct hist_reporter *reporter;
+	struct metrics *metrics;
+	FILE *log_out = stdout;
+
+	/* Let's get ready to start the worker thread. */
 	struct worker_params worker_params;
-	struct timespec reject_timestamp;
-	int worker_id, res;
+	int worker_id;
+
+	/* Pin ourselves before allocating the queue, so that its memory
+	 * ends up on the NUMA node of the event loop */
+	if (affinity_pin_self(affinity_cpu(&conn_params.placement, 0)) < 0)
+		perror("Unable to pin event loop thread");
+	else if (conn_params.placement.count > 0)
+		printf("INFO: Event loop pinned to CPU %d (node %d)\n",
+			   conn_params.placement.cpus[0],
+			   affinity_cpu_node(conn_params.placement.cpus[0]));
 
 	/* Now handle queue allocation and initialization */
-	/* IMPLEMENT ME !!*/
+	the_queue = queue_create(conn_params.queue_size, conn_params.policy);
+	if (the_queue == NULL)
+	{
+		ERROR_INFO();
+		perror("Unable to allocate request queue");
+		return;
+	}
+	queue_set_edf(the_queue, conn_params.slack, 1);
+	queue_set_spin(the_queue, conn_params.spin_ns);
+
+	/* Start the logger, with one ring for the worker and one for the
+	 * rejections issued by the event loop */
+	if (conn_params.log_file)
+	{
+		log_out = fopen(conn_params.log_file, "w");
+		if (log_out == NULL)
+		{
+			queue_destroy(the_queue);
+			ERROR_INFO();
+			perror("Unable to open log file");
+			return;
+		}
+	}
 
-	the_queue = (struct queue *)malloc(sizeof(struct queue));
-	queue_init(the_queue, conn_params.queue_size);
+	logger = log_create(log_out, conn_params.log_format, 2, &the_queue, 1,
+			    conn_params.queue_dump);
+	if (logger == NULL)
+	{
+		queue_destroy(the_queue);
+		if (log_out != stdout)
+			fclose(log_out);
+		ERROR_INFO();
+		perror("Unable to start logger");
+		return;
+	}
+
+	/* The logger inherited our CPU: let it use all of them instead */
+	affinity_pin_thread(logger->thread, &conn_params.placement);
+
+	/* Same for the thread reporting the latency percentiles, and for
+	 * the one serving the live metrics, if requested */
+	latency_init(&latency);
+	metrics = metrics_create(1, &latency, &the_queue, 1);
+	reporter = hist_reporter_create(stdout, conn_params.stats_interval, &latency, 1);
+	if (metrics == NULL || reporter == NULL
+	    || (conn_params.stats_sock && metrics_serve(metrics, conn_params.stats_sock) < 0))
+	{
+		if (reporter)
+			hist_reporter_destroy(reporter);
+		if (metrics)
+			metrics_destroy(metrics);
+		log_destroy(logger);
+		if (log_out != stdout)
+			fclose(log_out);
+		queue_destroy(the_queue);
+		ERROR_INFO();
+		perror("Unable to start latency reporter or metrics");
+		return;
+	}
+	affinity_pin_thread(reporter->thread, &conn_params.placement);
+	if (conn_params.stats_sock)
+	{
+		affinity_pin_thread(metrics->thread, &conn_params.placement);
+		printf("INFO: Serving metrics on %s\n", conn_params.stats_sock);
+	}
 
 	/* Prepare worker_parameters */
-	/* IMPLEMENT ME !!*/
-	worker_params.conn_socket = conn_socket;
-	worker_params.worker_done = worker_done;
+	worker_params.worker_done = 0;
 	worker_params.the_queue = the_queue;
+	worker_params.logger = logger;
+	worker_params.metrics = metrics;
+	worker_params.cpu = affinity_cpu(&conn_params.placement, 1);
 
-	worker_id = start_worker(&worker_params, worker_stack);
+	worker_id = start_worker(&worker_params, &conn_params.thread_attr);
 
 	if (worker_id < 0)
 	{
 		/* HANDLE WORKER CREATION ERROR */
-		free(worker_stack);
-		free(the_queue);
+		hist_reporter_destroy(reporter);
+		metrics_destroy(metrics);
+		log_destroy(logger);
+		if (log_out != stdout)
+			fclose(log_out);
+		queue_destroy(the_queue);
 		ERROR_INFO();
 		perror("Unable to create worker thread");
-		/* TODO fix premature return without socket shutdown */
 		return;
 	}
 
 	printf("INFO: Worker thread started. Thread ID = %d\n", worker_id);
+	if (worker_params.cpu != AFFINITY_NONE)
+		printf("INFO: Worker thread pinned to CPU %d (node %d)\n",
+			   worker_params.cpu, affinity_cpu_node(worker_params.cpu));
 
 	/* We are ready to proceed with the rest of the request
-	 * handling logic. */
-
-	req = (struct request_meta *)malloc(sizeof(struct request_meta));
-
-	do
-	{
-		/* IMPLEMENT ME: Receive next request from socket. */
-		in_bytes = recv(conn_socket, &req->request, sizeof(struct request), 0);
-		clock_gettime(CLOCK_MONOTONIC, &req->receipt_timestamp);
-
-		/* Don't just return if in_bytes is 0 or -1. Instead
-		 * skip the response and break out of the loop in an
-		 * orderly fashion so that we can de-allocate the req
-		 * and resp varaibles, and shutdown the socket. */
-
-		/* IMPLEMENT ME: Attempt to enqueue or reject request! */
-		if (in_bytes > 0)
-		{
-			res = add_to_queue(*req, the_queue);
-			if (res == 1)
-			{
-				clock_gettime(CLOCK_MONOTONIC, &reject_timestamp);
-				struct response resp;
-				resp.req_id = req->request.req_id;
-				resp.ack = 1;
-				send(conn_socket, &resp, sizeof(struct response), 0);
-				printf("X%ld:%lf,%lf,%lf\n", req->request.req_id,
-					   TSPEC_TO_DOUBLE(req->request.req_timestamp),
-					   TSPEC_TO_DOUBLE(req->request.req_length),
-					   TSPEC_TO_DOUBLE(reject_timestamp));
-			}
-		}
-		else
-		{
-			break;
-		}
-
-	} while (in_bytes > 0);
+	 * handling logic: serve all the clients until they are gone. */
+	handler.the_queue = the_queue;
+	handler.logger = logger;
+	handler.metrics = metrics;
+	conn_event_loop(listen_socket, handle_request, &handler);
 
 	/* Ask the worker thead to terminate */
 	printf("INFO: Asserting termination flag for worker thread...\n");
-	worker_done = 1;
+	worker_params.worker_done = 1;
 
 	/* Just in case the thread is stuck on the notify semaphore,
 	 * wake it up */
-	sem_post(queue_notify);
+	queue_wakeup(the_queue, 1);
 
 	/* Wait for orderly termination of the worker thread */
-	waitpid(-1, NULL, 0);
+	join_worker(&worker_params);
 	printf("INFO: Worker thread exited.\n");
-	free(worker_stack);
-	free(the_queue);
+	printf("INFO: Peak queue usage: %lu of %lu\n",
+		   queue_peak(the_queue), conn_params.queue_size);
+
+	/* The worker is gone: print the final percentiles */
+	hist_reporter_destroy(reporter);
+	metrics_destroy(metrics);
+
+	/* Nobody logs anymore: write out the rest of the log */
+	log_destroy(logger);
+	if (log_out != stdout)
+		fclose(log_out);
 
-	free(req);
-	shutdown(conn_socket, SHUT_RDWR);
-	close(conn_socket);
-	printf("INFO: Client disconnected.\n");
+	queue_destroy(the_queue);
 }
 
 /* Template implementation of the main function for the FIFO
@@ -397,11 +391,11 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
  * with the <port number> to bind the server to. */
 int main(int argc, char **argv)
 {
-	int sockfd, retval, accepted, optval, opt;
+	int sockfd, retval, optval, opt;
+	long value;
 	in_port_t socket_port;
-	struct sockaddr_in addr, client;
+	struct sockaddr_in addr;
 	struct in_addr any_address;
-	socklen_t client_len;
 
 	struct connection_params conn_params;
 
@@ -411,20 +405,126 @@ int main(int argc, char **argv)
 
 	/* 1. Detect the -q parameter and set aside the queue size in conn_params */
 	/* 2. Detect the port number to bind the server socket to (see HW1 and HW2) */
-	while ((opt = getopt(argc, argv, "q:")) != -1)
+	conn_params.policy = QUEUE_FIFO;
+	conn_params.slack = EDF_DEFAULT_SLACK;
+	conn_params.batch = 1;
+	conn_params.batch_delay = CONN_TX_DEFAULT_DELAY;
+	conn_params.log_format = LOG_TEXT;
+	conn_params.queue_dump = QUEUE_DUMP_FULL;
+	conn_params.spin_ns = 0;
+	conn_params.placement.count = 0;
+	conn_params.placement.cpus = NULL;
+	conn_params.thread_attr.stack_size = THREAD_DEFAULT_STACK;
+	conn_params.thread_attr.huge_pages = 0;
+	conn_params.log_file = NULL;
+	conn_params.stats_interval = 0;
+	conn_params.stats_sock = NULL;
+
+	while ((opt = getopt(argc, argv, "q:p:s:b:t:l:o:d:a:c:S:Hi:m:")) != -1)
 	{
 		switch (opt)
 		{
 		case 'q':
-			conn_params.queue_size = strtol(optarg, NULL, 10);
-			if (conn_params.queue_size <= 0)
+			value = strtol(optarg, NULL, 10);
+			if (value <= 0)
 			{
 				fprintf(stderr, "Invalid queue size\n");
 				return EXIT_FAILURE;
 			}
+			conn_params.queue_size = value;
+			break;
+		case 'p':
+			retval = queue_parse_policy(optarg);
+			if (retval < 0)
+			{
+				fprintf(stderr, "Invalid queue policy: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.policy = retval;
+			break;
+		case 's':
+			conn_params.slack = strtod(optarg, NULL);
+			if (conn_params.slack <= 0)
+			{
+				fprintf(stderr, "Invalid deadline slack\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			conn_params.batch = strtol(optarg, NULL, 10);
+			if (conn_params.batch <= 0 || conn_params.batch > CONN_TX_MAX)
+			{
+				fprintf(stderr, "Invalid batch size (1 to %d)\n", CONN_TX_MAX);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			conn_params.batch_delay = strtol(optarg, NULL, 10);
+			if (conn_params.batch_delay < 0)
+			{
+				fprintf(stderr, "Invalid batch delay\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			retval = log_parse_format(optarg);
+			if (retval < 0)
+			{
+				fprintf(stderr, "Invalid log format: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.log_format = retval;
+			break;
+		case 'o':
+			conn_params.log_file = optarg;
+			break;
+		case 'd':
+			retval = queue_parse_dump(optarg);
+			if (retval < 0)
+			{
+				fprintf(stderr, "Invalid queue dump mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.queue_dump = retval;
+			break;
+		case 'a':
+			if (queue_parse_spin(optarg, &conn_params.spin_ns) < 0)
+			{
+				fprintf(stderr, "Invalid spin budget: %s (at most %d us, or auto)\n",
+					optarg, QUEUE_SPIN_MAX_NS / 1000);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			if (affinity_parse(optarg, &conn_params.placement) < 0)
+			{
+				fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			if (thread_parse_stack(optarg, &conn_params.thread_attr) < 0)
+			{
+				fprintf(stderr, "Invalid stack size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			conn_params.thread_attr.huge_pages = 1;
+			break;
+		case 'i':
+			conn_params.stats_interval = strtod(optarg, NULL);
+			if (conn_params.stats_interval < 0)
+			{
+				fprintf(stderr, "Invalid statistics interval\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			conn_params.stats_sock = optarg;
 			break;
 		default:
-			fprintf(stderr, "Usage: %s [-q queue_size] port_number\n", argv[0]);
+			fprintf(stderr, "Usage: %s [-q queue_size] [-p policy] [-s slack] [-b batch] [-t delay] [-l log_format] [-o log_file] [-d queue_dump] [-a spin] [-c cpus] [-S stack] [-H] [-i interval] [-m metrics] port_number\n", argv[0]);
 			return EXIT_FAILURE;
 		}
 	}
@@ -442,6 +542,12 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	printf("INFO: setting queue policy as: %s\n", queue_policy_name(conn_params.policy));
+
+	/* Emulated service times count TSC cycles, if the TSC can be trusted */
+	tsc_calibrate();
+	tsc_report(stdout);
+
 	/* Now onward to create the right type of socket */
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -484,42 +590,18 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	/* Ready to accept connections! */
-	printf("INFO: Waiting for incoming connection...\n");
-	client_len = sizeof(struct sockaddr_in);
-	accepted = accept(sockfd, (struct sockaddr *)&client, &client_len);
-
-	if (accepted == -1)
-	{
-		ERROR_INFO();
-		perror("Unable to accept connections");
-		return EXIT_FAILURE;
-	}
-
-	/* Initialize queue protection variables. DO NOT TOUCH. */
-	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-	queue_notify = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(queue_mutex, 0, 1);
-	if (retval < 0)
-	{
-		ERROR_INFO();
-		perror("Unable to initialize queue mutex");
-		return EXIT_FAILURE;
-	}
-	retval = sem_init(queue_notify, 0, 0);
+	/* Set up response batching */
+	retval = conn_init(conn_params.batch, conn_params.batch_delay);
 	if (retval < 0)
 	{
 		ERROR_INFO();
-		perror("Unable to initialize queue notify");
+		perror("Unable to initialize connection handling");
 		return EXIT_FAILURE;
 	}
-	/* DONE - Initialize queue protection variables */
-
-	/* Ready to handle the new connection with the client. */
-	handle_connection(accepted, conn_params);
 
-	free(queue_mutex);
-	free(queue_notify);
+	/* Ready to accept connections and handle the clients! */
+	handle_connections(sockfd, conn_params);
+	affinity_free(&conn_params.placement);
 
 	close(sockfd);
 	return EXIT_SUCCESS;
@@ -6,14 +6,57 @@
 *     First Out (FIFO) order. The server binds to the specified port number
 *     provided as a parameter upon launch. It launches multiple threads to
 *     process incoming requests and allows to specify a maximum queue size.
+*     Any number of clients can be connected at the same time; their
+*     requests all go to the same queue, or are spread over one queue per
+*     worker, with idle workers stealing from their siblings.
 *
 * Usage:
-*     <build directory>/server -q <queue_size> -w <workers> <port_number>
+*     <build directory>/server -q <queue_size> -w <workers> [-p <policy>] [-s <slack>] [-b <batch>] [-t <delay>] [-l <log format>] [-o <log file>] [-d <queue dump>] [-a <spin>] [-c <cpus>] [-S <stack>] [-H] [-D <dispatch>] [-W] [-P] [-i <interval>] [-m <metrics>] <port_number>
 *
 * Parameters:
 *     port_number - The port number to bind the server to.
-*     queue_size  - The maximum number of queued requests
+*     queue_size  - The maximum number of queued requests, over all the
+*                   queues
 *     workers     - The number of workers to start to process requests
+*     policy      - The order in which queued requests are served: FIFO
+*                   (default), SJN (shortest job next) or EDF (earliest
+*                   deadline first)
+*     slack       - Under EDF, deadline of a request as a multiple of its
+*                   length past the time it was sent (default 5)
+*     batch       - Number of responses sent together (default 1, i.e.
+*                   no batching)
+*     delay       - Maximum time a batched response may wait, in
+*                   microseconds (default 1000)
+*     log format  - Format of the request log: text (default) or binary
+*                   (compact trace, see trace_conv)
+*     log file    - File the request log is written to (default: stdout)
+*     queue dump  - What the text log prints about the queue after each
+*                   request: full (default, all the queued IDs), summary
+*                   (length, queued work, oldest receipt time), off, or
+*                   split (the queued IDs of each per-worker queue)
+*     spin        - How long an idle worker spins before sleeping, in
+*                   microseconds (default 0, at most 50), or auto to
+*                   derive it from the inter-arrival times
+*     cpus        - CPUs to pin the threads to, e.g. 0-3,6: the first for
+*                   the event loop, the others spread over the workers,
+*                   local NUMA node first (default: no pinning)
+*     stack       - Size of the stack of each worker thread, in KB
+*                   (default 64)
+*     -H          - Back the stacks of the worker threads with huge pages
+*     dispatch    - How requests reach the workers: shared (default, one
+*                   queue for all), or per-worker queues filled by RR
+*                   (round-robin), JSQ (shortest queue first) or P2C
+*                   (shorter of two queues picked at random)
+*     -W          - Compare per-worker queues by queued work (sum of the
+*                   request lengths) rather than by number of requests
+*     -P          - Keep per-worker queues private: no work stealing
+*     interval    - How often to print the percentiles of the response
+*                   time, queueing delay and service time, in seconds
+*                   (default 0: only at shutdown)
+*     metrics     - Path of a UNIX socket serving snapshots of the live
+*                   metrics (queue depth, rejections, throughput, worker
+*                   utilization, latency percentiles) on request, in text
+*                   or, if the client sends "json", in JSON
 *
 * Author:
 *     Renato Mancuso
@@ -36,12 +79,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <sched.h>
 #include <signal.h>
-
-/* Needed for wait(...) */
-#include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/resource.h>
 
 /* Needed for semaphores */
 #include <semaphore.h>
@@ -50,171 +89,359 @@
  * included by both client and server */
 #include "common.h"
 
-#define BACKLOG_COUNT 100
-#define USAGE_STRING				\
-	"Missing parameter. Exiting.\n"		\
-	"Usage: %s -q <queue size> <port_number>\n"
+/* Request queues between this thread and the workers */
+#include "queue.h"
+#include "dispatch.h"
 
-/* 4KB of stack for the worker thread */
-#define STACK_SIZE (4096)
+/* Event loop serving all the client connections */
+#include "conn.h"
 
-/* START - Variables needed to protect the shared queue. DO NOT TOUCH */
-sem_t * queue_mutex;
-sem_t * queue_notify;
-/* END - Variables needed to protect the shared queue. DO NOT TOUCH */
+/* Log of the requests, written out by a separate thread */
+#include "log.h"
 
-struct request_meta {
-	struct request request;
+/* Pinning of the threads to CPUs */
+#include "affinity.h"
 
-	/* ADD REQUIRED FIELDS */
-};
+/* Creation and join of the worker threads */
+#include "thread.h"
 
-struct queue {
-	/* ADD REQUIRED FIELDS */
-};
+/* Latency histograms and live metrics kept by the workers */
+#include "hist.h"
+#include "metrics.h"
+
+#define BACKLOG_COUNT 100
+#define USAGE_STRING				\
+	"Missing parameter. Exiting.\n"		\
+	"Usage: %s -q <queue size> -w <workers> [-p <policy>] [-s <slack>] [-b <batch>] [-t <delay>] [-l <log format>] [-o <log file>] [-d <queue dump>] [-a <spin>] [-c <cpus>] [-S <stack>] [-H] [-D <dispatch>] [-W] [-P] [-i <interval>] [-m <metrics>] <port_number>\n"
+
+/* Serializes the messages printed directly by the workers and by the
+ * main thread. The per-request lines go through the logger instead. */
+sem_t * printf_mutex;
 
 struct connection_params {
-	/* ADD REQUIRED FIELDS */
+	size_t queue_size;
+	size_t workers;
+	enum queue_policy policy;
+	double slack;
+	size_t batch;
+	long batch_delay;
+	enum log_format log_format;
+	enum queue_dump queue_dump;
+	long spin_ns;
+	const char * log_file;
+	struct cpu_placement placement;
+	struct thread_attr thread_attr;
+	enum dispatch_policy dispatch;
+	int dispatch_by_work;
+	int dispatch_private;
+	double stats_interval;
+	const char * stats_sock;
 };
 
-struct worker_params {
-	/* ADD REQUIRED FIELDS */
+/* State passed to handle_request() by the event loop. The event loop
+ * owns the last ring of the logger. */
+struct handler_params {
+	struct dispatcher * disp;
+	struct logger * logger;
+	struct metrics * metrics;
+	int log_producer;
 };
 
-/* Helper function to perform queue initialization */
-void queue_init(struct queue * the_queue, size_t queue_size)
-{
-	/* IMPLEMENT ME !! */
-}
-
-/* Add a new request <request> to the shared queue <the_queue> */
-int add_to_queue(struct request_meta to_add, struct queue * the_queue)
-{
-	int retval = 0;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* Make sure that the queue is not full */
-	if (/* Condition to check for full queue */) {
-		/* What to do in case of a full queue */
-
-		/* DO NOT RETURN DIRECTLY HERE. The
-		 * sem_post(queue_mutex) below MUST happen. */
-	} else {
-		/* If all good, add the item in the queue */
-		/* IMPLEMENT ME !!*/
-
-		/* QUEUE SIGNALING FOR CONSUMER --- DO NOT TOUCH */
-		sem_post(queue_notify);
-	}
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
-}
-
-/* Add a new request <request> to the shared queue <the_queue> */
-struct request_meta get_from_queue(struct queue * the_queue)
-{
-	struct request_meta retval;
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_notify);
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
-
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
-
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-	return retval;
-}
+struct worker_params {
+	int worker_done;
+	struct dispatcher * disp;
+	struct logger * logger;
+	struct metrics * metrics;
 
-void dump_queue_status(struct queue * the_queue)
-{
-	/* QUEUE PROTECTION INTRO START --- DO NOT TOUCH */
-	sem_wait(queue_mutex);
-	/* QUEUE PROTECTION INTRO END --- DO NOT TOUCH */
+	/* Index of the worker and the CPU it is pinned to (or
+	 * AFFINITY_NONE) */
+	int worker_id;
+	int cpu;
 
-	/* WRITE YOUR CODE HERE! */
-	/* MAKE SURE NOT TO RETURN WITHOUT GOING THROUGH THE OUTRO CODE! */
+	/* The worker thread itself */
+	struct thread thread;
 
-	/* QUEUE PROTECTION OUTRO START --- DO NOT TOUCH */
-	sem_post(queue_mutex);
-	/* QUEUE PROTECTION OUTRO END --- DO NOT TOUCH */
-}
+	/* Time the worker started; its counters are in the metrics */
+	nstime_t alive_ns;
+};
 
 /* Main logic of the worker thread */
 int worker_main (void * arg)
 {
-	struct timespec now;
 	struct worker_params * params = (struct worker_params *)arg;
 
+	/* Stay on our own CPU from now on, if we were given one */
+	if (affinity_pin_self(params->cpu) < 0)
+		perror("Unable to pin worker thread");
+
 	/* Print the first alive message. */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	printf("[#WORKER#] %lf Worker Thread Alive!\n", TSPEC_TO_DOUBLE(now));
+	params->alive_ns = now_ns();
+	sem_wait(printf_mutex);
+	printf("[#WORKER#] " NSTIME_FMT " Worker Thread Alive!\n",
+	       NSTIME_ARGS(params->alive_ns));
+	sem_post(printf_mutex);
 
 	/* Okay, now execute the main logic. */
 	while (!params->worker_done) {
+		struct request_meta req;
+		struct response resp;
+		int stolen;
+
+		/* About to go idle: don't hold on to batched responses */
+		if (dispatch_pending(params->disp) == 0)
+			conn_flush_pending();
+
+		req = dispatch_get(params->disp, params->worker_id, &stolen);
+
+		/* We might have been woken up only to terminate */
+		if (params->worker_done)
+			break;
 
-		/* IMPLEMENT ME !! Main worker logic. */
+		req.start_ns = now_ns();
+		busywait_ns(req.length_ns);
+		req.completion_ns = now_ns();
 
-		dump_queue_status(params->the_queue);
+		/* Now provide a response, on the connection the
+		 * request came from! */
+		resp.req_id = req.req_id;
+		resp.ack = RESP_COMPLETED;
+		conn_send_response(req.conn, &resp);
+		conn_put(req.conn);
+
+		/* Account for the time spent serving this request */
+		metrics_completed(params->metrics, params->worker_id, &req, stolen);
+
+		/* Leave the printing (and the queue dump) to the logger */
+		log_completed(params->logger, params->worker_id, params->worker_id, &req);
 	}
 
 	return EXIT_SUCCESS;
 }
 
-/* This function will start the worker thread wrapping around the
- * clone() system call*/
-int start_worker(void * params, void * worker_stack)
+/* This function will start a worker thread, on a stack allocated as
+ * described by <attr>. Returns the thread ID of the worker, or -1 on
+ * failure. */
+int start_worker(struct worker_params * params, struct thread_attr * attr)
+{
+	if (thread_create(&params->thread, attr, worker_main, params) < 0)
+		return -1;
+
+	return thread_id(&params->thread);
+}
+
+/* Wait for orderly termination of a worker thread, and release its
+ * stack */
+void join_worker(struct worker_params * params)
 {
-	/* IMPLEMENT ME !! */
+	thread_join(&params->thread);
 }
 
-/* Main function to handle connection with the client. This function
- * takes in input conn_socket and returns only when the connection
- * with the client is interrupted. */
-void handle_connection(int conn_socket, struct connection_params conn_params)
+/* Called by the event loop for every request received from any of
+ * the clients: attempt to enqueue the request, or reject it right away
+ * on the connection it came from. */
+void handle_request(struct request_meta * req, void * arg)
 {
-	struct request_meta * req;
-	struct queue * the_queue;
-	size_t in_bytes;
+	struct handler_params * params = (struct handler_params *)arg;
+	nstime_t reject_ns;
+	struct response resp;
+
+	/* The dispatcher rejects the request if too many are pending
+	 * or, under EDF, if it can no longer meet its deadline. */
+	if (dispatch_add(params->disp, *req) == 0) {
+		metrics_accepted(params->metrics);
+		return;
+	}
 
-	/* IMPLEMENT ME!! Write a loop to start and initialize all the
-	 * worker threads ! */
+	metrics_rejected(params->metrics);
 
-	/* We are ready to proceed with the rest of the request
-	 * handling logic. */
+	reject_ns = now_ns();
+	resp.req_id = req->req_id;
+	resp.ack = RESP_REJECTED;
+	conn_send_response(req->conn, &resp);
+	conn_put(req->conn);
+
+	log_rejected(params->logger, params->log_producer, req, reject_ns);
+}
+
+/* Main function to handle connections with the clients. This function
+ * takes in input the listening socket and returns only when all the
+ * clients that connected to the server have disconnected. */
+void handle_connections(int listen_socket, struct connection_params conn_params)
+{
+	struct dispatcher * disp;
+	struct worker_params * workers;
+	struct handler_params handler;
+	struct logger * logger = NULL;
+	struct latency_hists * latency;
+	struct hist_reporter * reporter = NULL;
+	struct metrics * metrics = NULL;
+	struct metrics_worker * stats;
+	struct rusage usage;
+	size_t i, started = 0;
+	double lifetime, busy_time;
+	FILE * log_out = stdout;
+
+	/* Pin ourselves before allocating the queue, so that its memory
+	 * ends up on the NUMA node of the event loop */
+	if (affinity_pin_self(affinity_cpu(&conn_params.placement, 0)) < 0)
+		perror("Unable to pin event loop thread");
+	else if (conn_params.placement.count > 0)
+		printf("INFO: Event loop pinned to CPU %d (node %d)\n",
+		       conn_params.placement.cpus[0],
+		       affinity_cpu_node(conn_params.placement.cpus[0]));
+
+	/* Now handle queue allocation and initialization */
+	disp = dispatch_create(conn_params.dispatch, conn_params.queue_size,
+			       conn_params.workers, conn_params.policy);
+	workers = (struct worker_params *)calloc(conn_params.workers,
+						 sizeof(struct worker_params));
+	latency = (struct latency_hists *)aligned_alloc(CACHE_LINE_SIZE,
+		CACHE_LINE_ROUND(conn_params.workers * sizeof(struct latency_hists)));
+
+	if (disp == NULL || workers == NULL || latency == NULL) {
+		ERROR_INFO();
+		perror("Unable to allocate request queue");
+		goto out_free;
+	}
+	dispatch_set_edf(disp, conn_params.slack);
+	dispatch_set_spin(disp, conn_params.spin_ns);
+	dispatch_set_weight(disp, conn_params.dispatch_by_work);
+	dispatch_set_steal(disp, !conn_params.dispatch_private);
 
-	req = (struct request_meta *)malloc(sizeof(struct request_meta));
+	for (i = 0; i < conn_params.workers; ++i)
+		latency_init(&latency[i]);
 
-	do {
-		/* IMPLEMENT ME: Receive next request from socket. */
+	metrics = metrics_create(conn_params.workers, latency, disp->queues, disp->nr_queues);
+	if (metrics == NULL) {
+		ERROR_INFO();
+		perror("Unable to allocate metrics");
+		goto out_free;
+	}
 
-		/* Don't just return if in_bytes is 0 or -1. Instead
-		 * skip the response and break out of the loop in an
-		 * orderly fashion so that we can de-allocate the req
-		 * and resp varaibles, and shutdown the socket. */
+	/* Start the logger: one ring per worker, plus one for the
+	 * rejections issued by the event loop */
+	if (conn_params.log_file) {
+		log_out = fopen(conn_params.log_file, "w");
+		if (log_out == NULL) {
+			ERROR_INFO();
+			perror("Unable to open log file");
+			goto out_free;
+		}
+	}
+
+	logger = log_create(log_out, conn_params.log_format, conn_params.workers + 1,
+			    disp->queues, disp->nr_queues, conn_params.queue_dump);
+	if (logger == NULL) {
+		ERROR_INFO();
+		perror("Unable to start logger");
+		goto out_free;
+	}
 
-		/* IMPLEMENT ME: Attempt to enqueue or reject request! */
-	} while (in_bytes > 0);
+	/* The logger inherited our CPU: let it use all of them instead */
+	affinity_pin_thread(logger->thread, &conn_params.placement);
 
-	/* IMPLEMENT ME!! Write a loop to gracefully terminate all the
-	 * worker threads ! */
+	/* Same for the thread reporting the latency percentiles */
+	reporter = hist_reporter_create(stdout, conn_params.stats_interval,
+					latency, conn_params.workers);
+	if (reporter == NULL) {
+		ERROR_INFO();
+		perror("Unable to start latency reporter");
+		goto out_free;
+	}
+	affinity_pin_thread(reporter->thread, &conn_params.placement);
+
+	/* And for the one serving the live metrics, if requested */
+	if (conn_params.stats_sock) {
+		if (metrics_serve(metrics, conn_params.stats_sock) < 0) {
+			ERROR_INFO();
+			perror("Unable to serve metrics");
+			hist_reporter_destroy(reporter);
+			goto out_free;
+		}
+		affinity_pin_thread(metrics->thread, &conn_params.placement);
+		printf("INFO: Serving metrics on %s\n", conn_params.stats_sock);
+	}
 
-	free(the_queue);
+	/* Start and initialize all the worker threads */
+	for (started = 0; started < conn_params.workers; ++started) {
+		struct worker_params * w = &workers[started];
+
+		w->worker_done = 0;
+		w->disp = disp;
+		w->logger = logger;
+		w->metrics = metrics;
+		w->worker_id = started;
+		w->cpu = affinity_cpu(&conn_params.placement, started + 1);
+
+		if (start_worker(w, &conn_params.thread_attr) < 0) {
+			ERROR_INFO();
+			perror("Unable to create worker thread");
+			goto out_join;
+		}
+
+		sem_wait(printf_mutex);
+		printf("INFO: Worker thread %d started. Thread ID = %d\n",
+		       w->worker_id, thread_id(&w->thread));
+		if (w->cpu != AFFINITY_NONE)
+			printf("INFO: Worker thread %d pinned to CPU %d (node %d)\n",
+			       w->worker_id, w->cpu, affinity_cpu_node(w->cpu));
+		sem_post(printf_mutex);
+	}
 
-	free(req);
-	shutdown(conn_socket, SHUT_RDWR);
-	close(conn_socket);
-	printf("INFO: Client disconnected.\n");
+	/* We are ready to proceed with the rest of the request
+	 * handling logic: serve all the clients until they are gone. */
+	handler.disp = disp;
+	handler.logger = logger;
+	handler.metrics = metrics;
+	handler.log_producer = conn_params.workers;
+	conn_event_loop(listen_socket, handle_request, &handler);
+
+out_join:
+	/* Ask all the worker theads to terminate, then wake up the
+	 * ones that are stuck on the notify semaphore. */
+	printf("INFO: Asserting termination flag for worker threads...\n");
+	for (i = 0; i < started; ++i)
+		workers[i].worker_done = 1;
+	dispatch_wakeup(disp, started);
+
+	/* Wait for orderly termination of each worker thread */
+	for (i = 0; i < started; ++i) {
+		join_worker(&workers[i]);
+		lifetime = (double)(now_ns() - workers[i].alive_ns) / NANO_IN_SEC;
+		stats = &metrics->workers[i];
+		busy_time = (double)stats->busy_ns / NANO_IN_SEC;
+
+		printf("INFO: Worker thread %d exited. Completed: %lu "
+		       "Stolen: %lu Busy: %lf Utilization: %.2lf%%\n",
+		       workers[i].worker_id, stats->completed, stats->stolen, busy_time,
+		       (lifetime > 0 ? 100 * busy_time / lifetime : 0));
+	}
+	printf("INFO: Peak queue usage: %lu of %lu\n",
+	       dispatch_peak(disp), conn_params.queue_size);
+
+	/* CPU time actually consumed by the whole server, spinning
+	 * included, for the benchmark harness */
+	getrusage(RUSAGE_SELF, &usage);
+	printf("INFO: CPU time: user %lf system %lf over %lf s\n",
+	       usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+	       (double)(now_ns() - metrics->start_ns) / NANO_IN_SEC);
+
+	/* The workers are gone: print the final percentiles */
+	hist_reporter_destroy(reporter);
+
+out_free:
+	/* All the producers are gone: write out the rest of the log */
+	if (logger)
+		log_destroy(logger);
+	if (log_out != stdout && log_out != NULL)
+		fclose(log_out);
+	if (metrics)
+		metrics_destroy(metrics);
+	free(workers);
+	free(latency);
+	if (disp)
+		dispatch_destroy(disp);
 }
 
 
@@ -222,23 +449,189 @@ void handle_connection(int conn_socket, struct connection_params conn_params)
  * server. The server must accept in input a command line parameter
  * with the <port number> to bind the server to. */
 int main (int argc, char ** argv) {
-	int sockfd, retval, accepted, optval, opt;
+	int sockfd, retval, optval, opt;
+	long value;
 	in_port_t socket_port;
-	struct sockaddr_in addr, client;
+	struct sockaddr_in addr;
 	struct in_addr any_address;
-	socklen_t client_len;
 
 	struct connection_params conn_params;
 
 	/* Parse all the command line arguments */
-	/* IMPLEMENT ME!! */
-	/* PARSE THE COMMANDS LINE: */
-	/* 1. Detect the -q parameter and set aside the queue size in conn_params */
-	conn_params...
-	/* 2. Detect the -w parameter and set aside the number of threads to launch */
-	conn_params...
-	/* 3. Detect the port number to bind the server socket to (see HW1 and HW2) */
-	socket_port = ...
+	conn_params.queue_size = 0;
+	conn_params.workers = 1;
+	conn_params.policy = QUEUE_FIFO;
+	conn_params.slack = EDF_DEFAULT_SLACK;
+	conn_params.batch = 1;
+	conn_params.batch_delay = CONN_TX_DEFAULT_DELAY;
+	conn_params.log_format = LOG_TEXT;
+	conn_params.queue_dump = QUEUE_DUMP_FULL;
+	conn_params.spin_ns = 0;
+	conn_params.placement.count = 0;
+	conn_params.placement.cpus = NULL;
+	conn_params.thread_attr.stack_size = THREAD_DEFAULT_STACK;
+	conn_params.thread_attr.huge_pages = 0;
+	conn_params.log_file = NULL;
+	conn_params.dispatch = DISPATCH_SHARED;
+	conn_params.dispatch_by_work = 0;
+	conn_params.dispatch_private = 0;
+	conn_params.stats_interval = 0;
+	conn_params.stats_sock = NULL;
+
+	while ((opt = getopt(argc, argv, "q:w:p:s:b:t:l:o:d:a:c:S:HD:WPi:m:")) != -1) {
+		switch (opt) {
+		case 'q':
+			value = strtol(optarg, NULL, 10);
+			if (value <= 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid queue size\n");
+				return EXIT_FAILURE;
+			}
+			conn_params.queue_size = value;
+			break;
+		case 'w':
+			value = strtol(optarg, NULL, 10);
+			if (value <= 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid number of workers\n");
+				return EXIT_FAILURE;
+			}
+			conn_params.workers = value;
+			break;
+		case 'p':
+			retval = queue_parse_policy(optarg);
+			if (retval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid queue policy: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.policy = retval;
+			break;
+		case 's':
+			conn_params.slack = strtod(optarg, NULL);
+			if (conn_params.slack <= 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid deadline slack\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			conn_params.batch = strtol(optarg, NULL, 10);
+			if (conn_params.batch <= 0 || conn_params.batch > CONN_TX_MAX) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid batch size (1 to %d)\n", CONN_TX_MAX);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			conn_params.batch_delay = strtol(optarg, NULL, 10);
+			if (conn_params.batch_delay < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid batch delay\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			retval = log_parse_format(optarg);
+			if (retval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid log format: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.log_format = retval;
+			break;
+		case 'o':
+			conn_params.log_file = optarg;
+			break;
+		case 'd':
+			retval = queue_parse_dump(optarg);
+			if (retval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid queue dump mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.queue_dump = retval;
+			break;
+		case 'a':
+			if (queue_parse_spin(optarg, &conn_params.spin_ns) < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid spin budget: %s (at most %d us, or auto)\n",
+					optarg, QUEUE_SPIN_MAX_NS / 1000);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			if (affinity_parse(optarg, &conn_params.placement) < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			if (thread_parse_stack(optarg, &conn_params.thread_attr) < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid stack size: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			conn_params.thread_attr.huge_pages = 1;
+			break;
+		case 'D':
+			retval = dispatch_parse_policy(optarg);
+			if (retval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid dispatch policy: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			conn_params.dispatch = retval;
+			break;
+		case 'W':
+			conn_params.dispatch_by_work = 1;
+			break;
+		case 'P':
+			conn_params.dispatch_private = 1;
+			break;
+		case 'i':
+			conn_params.stats_interval = strtod(optarg, NULL);
+			if (conn_params.stats_interval < 0) {
+				ERROR_INFO();
+				fprintf(stderr, "Invalid statistics interval\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			conn_params.stats_sock = optarg;
+			break;
+		default:
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (conn_params.queue_size == 0) {
+		ERROR_INFO();
+		fprintf(stderr, "Queue size must be given and positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Detect the port number to bind the server socket to */
+	if (optind < argc) {
+		socket_port = strtol(argv[optind], NULL, 10);
+		printf("INFO: setting server port as: %d\n", socket_port);
+		printf("INFO: setting queue policy as: %s\n",
+		       queue_policy_name(conn_params.policy));
+		printf("INFO: setting dispatch policy as: %s\n",
+		       dispatch_policy_name(conn_params.dispatch));
+	} else {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Emulated service times count TSC cycles, if the TSC can be trusted */
+	tsc_calibrate();
+	tsc_report(stdout);
 
 	/* Now onward to create the right type of socket */
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -279,39 +672,28 @@ int main (int argc, char ** argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Ready to accept connections! */
-	printf("INFO: Waiting for incoming connection...\n");
-	client_len = sizeof(struct sockaddr_in);
-	accepted = accept(sockfd, (struct sockaddr *)&client, &client_len);
-
-	if (accepted == -1) {
-		ERROR_INFO();
-		perror("Unable to accept connections");
-		return EXIT_FAILURE;
-	}
-
-	/* Initialize queue protection variables. DO NOT TOUCH. */
-	queue_mutex = (sem_t *)malloc(sizeof(sem_t));
-	queue_notify = (sem_t *)malloc(sizeof(sem_t));
-	retval = sem_init(queue_mutex, 0, 1);
+	/* Initialize the output protection variable */
+	printf_mutex = (sem_t *)malloc(sizeof(sem_t));
+	retval = sem_init(printf_mutex, 0, 1);
 	if (retval < 0) {
 		ERROR_INFO();
-		perror("Unable to initialize queue mutex");
+		perror("Unable to initialize printf mutex");
 		return EXIT_FAILURE;
 	}
-	retval = sem_init(queue_notify, 0, 0);
+
+	/* Set up response batching */
+	retval = conn_init(conn_params.batch, conn_params.batch_delay);
 	if (retval < 0) {
 		ERROR_INFO();
-		perror("Unable to initialize queue notify");
+		perror("Unable to initialize connection handling");
 		return EXIT_FAILURE;
 	}
-	/* DONE - Initialize queue protection variables */
 
-	/* Ready to handle the new connection with the client. */
-	handle_connection(accepted, conn_params);
+	/* Ready to accept connections and handle the clients! */
+	handle_connections(sockfd, conn_params);
+	affinity_free(&conn_params.placement);
 
-	free(queue_mutex);
-	free(queue_notify);
+	free(printf_mutex);
 
 	close(sockfd);
 	return EXIT_SUCCESS;
@@ -0,0 +1,147 @@
+/*******************************************************************************
+* Worker Threads (implementation)
+*
+* Description:
+*     Thin layer over POSIX threads used to start and join the workers of
+*     the servers, on stacks with a guard page and an optional huge-page
+*     backing.
+*
+* Notes:
+*     The stack is a single anonymous mapping: its lowest page is made
+*     inaccessible and serves as the guard, and the rest is handed to
+*     pthread_attr_setstack(). Since the stack is ours, pthreads does not
+*     add a guard of its own, and we unmap it after the join.
+*
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "thread.h"
+
+/* Translate a stack size given on the command line in KB into <attr>.
+ * Returns 0 on success and -1 if the size is not valid. */
+int thread_parse_stack(const char * arg, struct thread_attr * attr)
+{
+	char * end;
+	long size_kb;
+
+	size_kb = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || size_kb <= 0)
+		return -1;
+
+	if (size_kb * 1024 < (long)PTHREAD_STACK_MIN)
+		return -1;
+
+	attr->stack_size = size_kb * 1024;
+	return 0;
+}
+
+/* Entry point of every thread: publish our ID, then run the actual
+ * thread function */
+static void * thread_trampoline(void * arg)
+{
+	struct thread * thread = (struct thread *)arg;
+
+	atomic_store_explicit(&thread->tid, syscall(SYS_gettid), memory_order_release);
+	thread->retval = thread->fn(thread->arg);
+
+	return NULL;
+}
+
+/* Map a stack of <size> bytes with a guard page below it. Returns the
+ * lowest usable address, or NULL on failure. */
+static void * stack_alloc(struct thread * thread, size_t size, int huge_pages)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	size = (size + page - 1) / page * page;
+	if (huge_pages)
+		size = (size + THREAD_HUGE_PAGE - 1) / THREAD_HUGE_PAGE * THREAD_HUGE_PAGE;
+
+	thread->map_size = size + page;
+	thread->map = mmap(NULL, thread->map_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (thread->map == MAP_FAILED) {
+		thread->map = NULL;
+		return NULL;
+	}
+
+	if (mprotect(thread->map, page, PROT_NONE) < 0)
+		goto err_unmap;
+
+	/* Only a hint: regular pages are fine if it is not honored */
+	if (huge_pages)
+		madvise(thread->map + page, size, MADV_HUGEPAGE);
+
+	return thread->map + page;
+
+err_unmap:
+	munmap(thread->map, thread->map_size);
+	thread->map = NULL;
+	return NULL;
+}
+
+/* Start a thread running fn(arg) on a stack allocated as described by
+ * <attr> (or with the defaults, if NULL). Returns once the thread is
+ * running and its ID is known. Returns 0 on success and -1 on
+ * failure. */
+int thread_create(struct thread * thread, struct thread_attr * attr,
+		  int (*fn)(void *), void * arg)
+{
+	pthread_attr_t pattr;
+	size_t stack_size = (attr ? attr->stack_size : THREAD_DEFAULT_STACK);
+	void * stack;
+	int retval;
+
+	thread->fn = fn;
+	thread->arg = arg;
+	thread->retval = 0;
+	atomic_init(&thread->tid, 0);
+
+	stack = stack_alloc(thread, stack_size, (attr ? attr->huge_pages : 0));
+	if (stack == NULL)
+		return -1;
+
+	pthread_attr_init(&pattr);
+	pthread_attr_setstack(&pattr, stack, thread->map_size - (stack - thread->map));
+	retval = pthread_create(&thread->handle, &pattr, thread_trampoline, thread);
+	pthread_attr_destroy(&pattr);
+
+	if (retval != 0) {
+		munmap(thread->map, thread->map_size);
+		thread->map = NULL;
+		return -1;
+	}
+
+	/* Wait for the thread to tell us who it is */
+	while (atomic_load_explicit(&thread->tid, memory_order_acquire) == 0)
+		sched_yield();
+
+	return 0;
+}
+
+/* Wait for the thread to exit and release its stack. Returns the value
+ * returned by its function. */
+int thread_join(struct thread * thread)
+{
+	pthread_join(thread->handle, NULL);
+
+	munmap(thread->map, thread->map_size);
+	thread->map = NULL;
+
+	return thread->retval;
+}
+
+/* Return the kernel ID of a running thread */
+pid_t thread_id(struct thread * thread)
+{
+	return atomic_load_explicit(&thread->tid, memory_order_relaxed);
+}
@@ -0,0 +1,72 @@
+/*******************************************************************************
+* Worker Threads (header)
+*
+* Description:
+*     Thin layer over POSIX threads used to start and join the workers of
+*     the servers. Each thread runs on a stack allocated by this layer,
+*     with a size chosen on the command line, an inaccessible guard page
+*     below it so that an overflow crashes right away instead of silently
+*     corrupting memory, and optionally backed by huge pages.
+*
+* Notes:
+*     Huge pages are requested with madvise(MADV_HUGEPAGE), i.e. through
+*     transparent huge pages. The stack is then rounded up to a multiple
+*     of the huge page size; if the kernel does not support transparent
+*     huge pages, the stack simply uses regular pages.
+*
+*******************************************************************************/
+
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/* Default size of the stack of a thread, in bytes */
+#define THREAD_DEFAULT_STACK (64 * 1024)
+
+/* Size of a huge page, to which huge-page stacks are rounded up */
+#define THREAD_HUGE_PAGE (2 * 1024 * 1024)
+
+/* How the stack of a thread is allocated */
+struct thread_attr {
+	size_t stack_size;
+	int huge_pages;
+};
+
+struct thread {
+	pthread_t handle;
+
+	/* Function run by the thread, and its argument */
+	int (*fn)(void *);
+	void * arg;
+
+	/* Whole stack mapping, guard page included */
+	void * map;
+	size_t map_size;
+
+	/* Kernel thread ID, and return value of fn once joined */
+	atomic_int tid;
+	int retval;
+};
+
+/* Translate a stack size given on the command line in KB into <attr>.
+ * Returns 0 on success and -1 if the size is not valid. */
+int thread_parse_stack(const char * arg, struct thread_attr * attr);
+
+/* Start a thread running fn(arg) on a stack allocated as described by
+ * <attr> (or with the defaults, if NULL). Returns once the thread is
+ * running and its ID is known. Returns 0 on success and -1 on
+ * failure. */
+int thread_create(struct thread * thread, struct thread_attr * attr,
+		  int (*fn)(void *), void * arg);
+
+/* Wait for the thread to exit and release its stack. Returns the value
+ * returned by its function. */
+int thread_join(struct thread * thread);
+
+/* Return the kernel ID of a running thread */
+pid_t thread_id(struct thread * thread);
+
+#endif
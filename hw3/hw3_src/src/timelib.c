@@ -20,8 +20,111 @@
 *
 *******************************************************************************/
 
+#include <cpuid.h>
+#include <math.h>
+
 #include "timelib.h"
 
+/* Outcome of tsc_calibrate() */
+struct tsc_calibration tsc;
+
+/* Return nonzero if CPUID reports an invariant TSC, i.e. one ticking
+ * at a constant rate in all P-, C- and T-states */
+static int tsc_is_invariant(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+		return 0;
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx >> 8) & 1;
+}
+
+/* Measure the frequency of the TSC once, in cycles per nanosecond.
+ * Busy wait rather than sleep, so that the CPU does not change
+ * frequency or get descheduled under us. */
+static double tsc_sample(void)
+{
+	uint64_t start, end;
+	struct timespec t_start, t_end;
+	int64_t elapsed_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	get_clocks(start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		get_clocks(end);
+		elapsed_ns = (int64_t)(t_end.tv_sec - t_start.tv_sec) * NANO_IN_SEC
+			+ (t_end.tv_nsec - t_start.tv_nsec);
+	} while (elapsed_ns < TSC_CALIBRATION_NS);
+
+	return (double)(end - start) / elapsed_ns;
+}
+
+/* Compare two doubles, for qsort() */
+static int double_cmp(const void * a, const void * b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Check whether the TSC is invariant and measure its frequency (see
+ * struct tsc_calibration). Returns 0 if the TSC can be used for
+ * timing and -1 otherwise. */
+int tsc_calibrate(void)
+{
+	double samples[TSC_CALIBRATION_SAMPLES];
+	double median, mean = 0, var = 0;
+	struct timespec now;
+	int i;
+
+	memset(&tsc, 0, sizeof(tsc));
+	tsc.invariant = tsc_is_invariant();
+
+	for (i = 0; i < TSC_CALIBRATION_SAMPLES; ++i) {
+		samples[i] = tsc_sample();
+		mean += samples[i] / TSC_CALIBRATION_SAMPLES;
+	}
+	for (i = 0; i < TSC_CALIBRATION_SAMPLES; ++i)
+		var += (samples[i] - mean) * (samples[i] - mean) / TSC_CALIBRATION_SAMPLES;
+
+	qsort(samples, TSC_CALIBRATION_SAMPLES, sizeof(double), double_cmp);
+	median = samples[TSC_CALIBRATION_SAMPLES / 2];
+
+	tsc.cycles_per_ns = median;
+	tsc.stddev = sqrt(var);
+	tsc.usable = (tsc.invariant && median > 0
+		      && sqrt(var) / median < TSC_MAX_SPREAD);
+	if (!tsc.usable)
+		return -1;
+
+	/* Take the reference point of tsc_now_ns() as close together as
+	 * we can */
+	tsc.mult = (uint64_t)((double)((uint64_t)1 << TSC_SHIFT) / median);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	get_clocks(tsc.base_cycles);
+	tsc.base_ns = (uint64_t)now.tv_sec * NANO_IN_SEC + now.tv_nsec;
+
+	return 0;
+}
+
+/* Print the outcome of tsc_calibrate(), saying clearly whether the TSC
+ * is used */
+void tsc_report(FILE * out)
+{
+	fprintf(out, "INFO: TSC frequency: %.3lf MHz (median of %d samples, "
+		"stddev %.3lf MHz), %sinvariant\n", tsc.cycles_per_ns * 1000,
+		TSC_CALIBRATION_SAMPLES, tsc.stddev * 1000, (tsc.invariant ? "" : "not "));
+
+	if (tsc.usable)
+		fprintf(out, "INFO: Using the TSC for busy waits\n");
+	else
+		fprintf(out, "WARNING: TSC unusable (%s): falling back to clock_gettime()\n",
+			(tsc.invariant ? "unstable frequency" : "not invariant"));
+}
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec)
@@ -63,7 +166,7 @@ uint64_t get_elapsed_busywait(long sec, long nsec)
 	/* Busy wait until enough time has elapsed */
 	do {
 		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (time_end.tv_sec > now.tv_sec || time_end.tv_nsec > now.tv_nsec);
+	} while (timespec_cmp(&time_end, &now) > 0);
 
 	/* Get end timestamp */
 	get_clocks(end);
@@ -79,7 +182,7 @@ void timespec_add (struct timespec * a, struct timespec * b)
 	 * seconds */
 	time_t addl_seconds = b->tv_sec;
 	a->tv_nsec += b->tv_nsec;
-	if (a->tv_nsec > NANO_IN_SEC) {
+	if (a->tv_nsec >= NANO_IN_SEC) {
 		addl_seconds += a->tv_nsec / NANO_IN_SEC;
 		a->tv_nsec = a->tv_nsec % NANO_IN_SEC;
 	}
@@ -102,23 +205,56 @@ int timespec_cmp(struct timespec *a, struct timespec *b)
 }
 
 /* Busywait for the amount of time described via the delay
- * parameter */
+ * parameter. Returns the number of clock cycles elapsed. */
 uint64_t busywait_timespec(struct timespec delay)
+{
+	return busywait_ns(timespec_to_ns(&delay));
+}
+
+/* Same as busywait_timespec(), for a delay given in nanoseconds. Counts
+ * TSC cycles if the TSC is usable, and polls clock_gettime() if not. */
+uint64_t busywait_ns(nstime_t delay)
+{
+	/* With a calibrated TSC, just count cycles: much cheaper and
+	 * finer-grained than going through clock_gettime() */
+	if (tsc.usable)
+		return busywait_tsc_ns(delay);
+
+	return busywait_clock_ns(delay);
+}
+
+/* Busywait for <delay> nanoseconds by counting TSC cycles. Only valid
+ * if the TSC is usable. */
+uint64_t busywait_tsc_ns(nstime_t delay)
+{
+	uint64_t start, end, cycles;
+
+	cycles = delay * tsc.cycles_per_ns;
+
+	get_clocks(start);
+	do {
+		cpu_relax();
+		get_clocks(end);
+	} while (end - start < cycles);
+
+	return (end - start);
+}
+
+/* Busywait for <delay> nanoseconds by polling clock_gettime() */
+uint64_t busywait_clock_ns(nstime_t delay)
 {
 	uint64_t start, end;
-	struct timespec now;
+	nstime_t deadline;
 
 	/* Measure the current system time */
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	timespec_add(&delay, &now);
+	deadline = now_ns() + delay;
 
 	/* Get the start timestamp */
 	get_clocks(start);
 
 	/* Busy wait until enough time has elapsed */
-	do {
-		clock_gettime(CLOCK_MONOTONIC, &now);
-	} while (delay.tv_sec > now.tv_sec || delay.tv_nsec > now.tv_nsec);
+	while (now_ns() < deadline)
+		;
 
 	/* Get end timestamp */
 	get_clocks(end);
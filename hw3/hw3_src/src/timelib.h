@@ -20,6 +20,9 @@
 *
 *******************************************************************************/
 
+#ifndef __TIMELIB_H__
+#define __TIMELIB_H__
+
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -42,6 +45,101 @@
 			((uint64_t)__clocks_lo);			\
 	} while (0)
 
+/* Hint to the CPU that we are spinning on a shared location */
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+
+/* tsc_calibrate() takes TSC_CALIBRATION_SAMPLES measurements of the
+ * TSC frequency against CLOCK_MONOTONIC, each TSC_CALIBRATION_NS
+ * nanoseconds long, and keeps the median. The TSC is only used if
+ * CPUID reports it as invariant and the measurements agree to within
+ * TSC_MAX_SPREAD (relative standard deviation). */
+#define TSC_CALIBRATION_SAMPLES 9
+#define TSC_CALIBRATION_NS (5 * 1000 * 1000)
+#define TSC_MAX_SPREAD 0.01
+
+/* Fixed-point shift of the cycles to nanoseconds conversion */
+#define TSC_SHIFT 32
+
+/* Outcome of the calibration of the TSC, frequencies in cycles per
+ * nanosecond. Everything that times with the TSC checks usable first. */
+struct tsc_calibration {
+	int invariant;		/* CPUID reports an invariant TSC */
+	int usable;		/* Invariant and stable: used for timing */
+	double cycles_per_ns;	/* Median of the measured frequencies */
+	double stddev;		/* Standard deviation of the measurements */
+
+	/* Reference point of tsc_now_ns(), taken together at the end of
+	 * the calibration, and ns = cycles * mult >> TSC_SHIFT */
+	uint64_t base_cycles;
+	uint64_t base_ns;
+	uint64_t mult;
+};
+
+extern struct tsc_calibration tsc;
+
+/* Check whether the TSC is invariant and measure its frequency (see
+ * struct tsc_calibration). Returns 0 if the TSC can be used for
+ * timing and -1 otherwise. */
+int tsc_calibrate(void);
+
+/* Print the outcome of tsc_calibrate(), saying clearly whether the TSC
+ * is used */
+void tsc_report(FILE * out);
+
+/* Convert a number of TSC cycles into nanoseconds. Only valid if the
+ * TSC is usable. */
+static inline uint64_t tsc_to_ns(uint64_t cycles)
+{
+	return (uint64_t)(((unsigned __int128)cycles * tsc.mult) >> TSC_SHIFT);
+}
+
+/* Return the current CLOCK_MONOTONIC time in nanoseconds, computed
+ * from the TSC without a system call. Only valid if the TSC is
+ * usable. */
+static inline uint64_t tsc_now_ns(void)
+{
+	uint64_t now;
+
+	get_clocks(now);
+	return tsc.base_ns + tsc_to_ns(now - tsc.base_cycles);
+}
+
+/* A point in CLOCK_MONOTONIC time, or a duration, in nanoseconds. All
+ * the timestamps the servers keep are of this type; struct timespec is
+ * only used on the wire and for system calls. */
+typedef uint64_t nstime_t;
+
+/* Print an nstime_t as seconds with all nine decimals, i.e. exactly:
+ * printf(NSTIME_FMT, NSTIME_ARGS(ns)) */
+#define NSTIME_FMT "%lu.%09lu"
+#define NSTIME_ARGS(ns)							\
+	(unsigned long)((ns) / NANO_IN_SEC), (unsigned long)((ns) % NANO_IN_SEC)
+
+/* Convert a timespec into nanoseconds */
+static inline nstime_t timespec_to_ns(const struct timespec * spec)
+{
+	return (nstime_t)spec->tv_sec * NANO_IN_SEC + spec->tv_nsec;
+}
+
+/* Convert nanoseconds into a timespec */
+static inline struct timespec ns_to_timespec(nstime_t ns)
+{
+	struct timespec retval;
+
+	retval.tv_sec = ns / NANO_IN_SEC;
+	retval.tv_nsec = ns % NANO_IN_SEC;
+	return retval;
+}
+
+/* Return the current CLOCK_MONOTONIC time in nanoseconds */
+static inline nstime_t now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_ns(&now);
+}
+
 /* Return the number of clock cycles elapsed when waiting for
  * wait_time seconds using sleeping functions */
 uint64_t get_elapsed_sleep(long sec, long nsec);
@@ -51,9 +149,18 @@ uint64_t get_elapsed_sleep(long sec, long nsec);
 uint64_t get_elapsed_busywait(long sec, long nsec);
 
 /* Busywait for the amount of time described via the delay
- * parameter */
+ * parameter. Returns the number of clock cycles elapsed. */
 uint64_t busywait_timespec(struct timespec delay);
 
+/* Same as busywait_timespec(), for a delay given in nanoseconds. Counts
+ * TSC cycles if the TSC is usable, and polls clock_gettime() if not. */
+uint64_t busywait_ns(nstime_t delay);
+
+/* The two ways busywait_ns() can wait, for when the choice must not be
+ * left to it. busywait_tsc_ns() is only valid if the TSC is usable. */
+uint64_t busywait_tsc_ns(nstime_t delay);
+uint64_t busywait_clock_ns(nstime_t delay);
+
 /* Add two timespec structures together */
 void timespec_add (struct timespec *, struct timespec *);
 
@@ -62,3 +169,5 @@ int timespec_cmp(struct timespec *, struct timespec *);
 
 /* Translate a double timestamp into a valid timespec */
 struct timespec dtotspec(double timestamp);
+
+#endif
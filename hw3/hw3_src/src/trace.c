@@ -0,0 +1,128 @@
+/*******************************************************************************
+* Binary Request Trace (implementation)
+*
+* Description:
+*     Compact on-disk format for the request log. A trace file starts with
+*     a small header, followed by one fixed-size record per completed or
+*     rejected request.
+*
+* Notes:
+*     On-disk layout of a record (all fields little-endian):
+*
+*         offset  size  field
+*         0       8     req_id
+*         8       8     sent_ns
+*         16      8     length_ns
+*         24      8     receipt_ns
+*         32      8     start_ns
+*         40      8     completion_ns
+*         48      1     ack
+*         49      1     (reserved, zero)
+*         50      2     worker
+*         52      4     queue_len
+*
+*******************************************************************************/
+
+#include <endian.h>
+
+#include "trace.h"
+
+/* Write the trace file header to <out>. Returns 0 on success, -1 on
+ * failure. */
+int trace_write_header(FILE * out)
+{
+	uint8_t buf[TRACE_HEADER_SIZE];
+	uint16_t version = htole16(TRACE_VERSION);
+	uint16_t size = htole16(TRACE_RECORD_SIZE);
+
+	memcpy(&buf[0], TRACE_MAGIC, 4);
+	memcpy(&buf[4], &version, 2);
+	memcpy(&buf[6], &size, 2);
+
+	return (fwrite(buf, TRACE_HEADER_SIZE, 1, out) == 1 ? 0 : -1);
+}
+
+/* Read and check the trace file header from <in>. Returns 0 if the
+ * stream holds a trace in a supported version, -1 otherwise. */
+int trace_read_header(FILE * in)
+{
+	uint8_t buf[TRACE_HEADER_SIZE];
+	uint16_t version, size;
+
+	if (fread(buf, TRACE_HEADER_SIZE, 1, in) != 1)
+		return -1;
+
+	memcpy(&version, &buf[4], 2);
+	memcpy(&size, &buf[6], 2);
+
+	if (memcmp(&buf[0], TRACE_MAGIC, 4) != 0
+	    || le16toh(version) != TRACE_VERSION
+	    || le16toh(size) != TRACE_RECORD_SIZE)
+		return -1;
+
+	return 0;
+}
+
+/* Store a 64-bit value at <buf> in little-endian order */
+static inline void put_le64(uint8_t * buf, uint64_t val)
+{
+	val = htole64(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+/* Load a 64-bit little-endian value from <buf> */
+static inline uint64_t get_le64(uint8_t * buf)
+{
+	uint64_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return le64toh(val);
+}
+
+/* Write <rec> to <out> in the on-disk format. Returns 0 on success,
+ * -1 on failure. */
+int trace_write(FILE * out, struct trace_record * rec)
+{
+	uint8_t buf[TRACE_RECORD_SIZE];
+	uint16_t worker = htole16((uint16_t)rec->worker);
+	uint32_t queue_len = htole32(rec->queue_len);
+
+	put_le64(&buf[0], rec->req_id);
+	put_le64(&buf[8], rec->sent_ns);
+	put_le64(&buf[16], rec->length_ns);
+	put_le64(&buf[24], rec->receipt_ns);
+	put_le64(&buf[32], rec->start_ns);
+	put_le64(&buf[40], rec->completion_ns);
+	buf[48] = rec->ack;
+	buf[49] = 0;
+	memcpy(&buf[50], &worker, 2);
+	memcpy(&buf[52], &queue_len, 4);
+
+	return (fwrite(buf, TRACE_RECORD_SIZE, 1, out) == 1 ? 0 : -1);
+}
+
+/* Read the next record from <in> into <rec>. Returns 0 on success, -1
+ * at the end of the trace or if the last record is truncated. */
+int trace_read(FILE * in, struct trace_record * rec)
+{
+	uint8_t buf[TRACE_RECORD_SIZE];
+	uint16_t worker;
+	uint32_t queue_len;
+
+	if (fread(buf, TRACE_RECORD_SIZE, 1, in) != 1)
+		return -1;
+
+	rec->req_id = get_le64(&buf[0]);
+	rec->sent_ns = get_le64(&buf[8]);
+	rec->length_ns = get_le64(&buf[16]);
+	rec->receipt_ns = get_le64(&buf[24]);
+	rec->start_ns = get_le64(&buf[32]);
+	rec->completion_ns = get_le64(&buf[40]);
+	rec->ack = buf[48];
+	memcpy(&worker, &buf[50], 2);
+	memcpy(&queue_len, &buf[52], 4);
+	rec->worker = (int16_t)le16toh(worker);
+	rec->queue_len = le32toh(queue_len);
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*******************************************************************************
+* Binary Request Trace (header)
+*
+* Description:
+*     Compact on-disk format for the request log. A trace file starts with
+*     a small header, followed by one fixed-size record per completed or
+*     rejected request. All the timestamps are stored as nanoseconds, so
+*     that a record takes a fraction of the space of the corresponding R/X
+*     text line and of the queue dump that follows it.
+*
+* Notes:
+*     Every field is stored little-endian, whatever the host byte order,
+*     so that traces can be moved between machines. Records are written
+*     with explicit offsets rather than by dumping a struct, to keep the
+*     layout free of compiler padding.
+*
+*******************************************************************************/
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+#include "common.h"
+
+/* Identifies a trace file, followed by the version of the format */
+#define TRACE_MAGIC "CSTR"
+#define TRACE_VERSION 1
+
+/* Size of the file header and of one record on disk, in bytes */
+#define TRACE_HEADER_SIZE 8
+#define TRACE_RECORD_SIZE 56
+
+/* One request as stored in a trace. For a rejected request, only
+ * sent, length, receipt and completion (the time of the rejection)
+ * are meaningful. A negative worker means that the worker ID is not
+ * printed. */
+struct trace_record {
+	uint64_t req_id;
+	int64_t sent_ns;
+	int64_t length_ns;
+	int64_t receipt_ns;
+	int64_t start_ns;
+	int64_t completion_ns;
+	uint8_t ack;
+	int16_t worker;
+	uint32_t queue_len;
+};
+
+/* Convert nanoseconds into seconds, as a double */
+#define NSEC_TO_DOUBLE(ns)				\
+	((double)(ns) / NANO_IN_SEC)
+
+/* Write the trace file header to <out>. Returns 0 on success, -1 on
+ * failure. */
+int trace_write_header(FILE * out);
+
+/* Read and check the trace file header from <in>. Returns 0 if the
+ * stream holds a trace in a supported version, -1 otherwise. */
+int trace_read_header(FILE * in);
+
+/* Write <rec> to <out> in the on-disk format. Returns 0 on success,
+ * -1 on failure. */
+int trace_write(FILE * out, struct trace_record * rec);
+
+/* Read the next record from <in> into <rec>. Returns 0 on success, -1
+ * at the end of the trace or if the last record is truncated. */
+int trace_read(FILE * in, struct trace_record * rec);
+
+#endif
@@ -0,0 +1,196 @@
+/*******************************************************************************
+* Binary Trace Converter
+*
+* Description:
+*     Reads a binary request trace written by the servers with -l binary
+*     and either prints it back in the usual text format (one R or X line
+*     per request, in the order they were logged) or computes summary
+*     statistics over the whole trace in a single pass.
+*
+* Usage:
+*     <build directory>/trace_conv [-s] [-q] <trace file>
+*
+* Parameters:
+*     trace file  - The binary trace to read, or - for standard input
+*     -s          - Print summary statistics instead of the text lines
+*     -q          - After every R line, print the length of the queue at
+*                   the time of the completion as "Q:<length>"
+*
+* Notes:
+*     The trace only records the length of the queue, not the IDs of the
+*     queued requests, so the Q:[...] lines of the text log cannot be
+*     reproduced. Scripts that only look at R and X lines can read the
+*     output of this tool unchanged.
+*
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define USAGE_STRING				\
+	"Missing parameter. Exiting.\n"		\
+	"Usage: %s [-s] [-q] <trace file>\n"
+
+/* Statistics accumulated over the whole trace */
+struct trace_stats {
+	uint64_t completed;
+	uint64_t rejected;
+
+	/* Sums over the completed requests, in nanoseconds */
+	double busy_ns;
+	double response_ns;
+	double wait_ns;
+	int64_t max_response_ns;
+
+	/* Sum of the queue lengths seen at each completion */
+	double queue_len;
+
+	/* Number of workers that completed requests */
+	int workers;
+
+	/* Time span covered by the trace */
+	int64_t first_ns;
+	int64_t last_ns;
+};
+
+/* Print one record in the text format of the servers */
+void print_record(struct trace_record * rec, int print_queue)
+{
+	if (rec->ack == RESP_REJECTED) {
+		printf("X%ld:" NSTIME_FMT "," NSTIME_FMT "," NSTIME_FMT "\n",
+		       rec->req_id, NSTIME_ARGS(rec->sent_ns), NSTIME_ARGS(rec->length_ns),
+		       NSTIME_ARGS(rec->completion_ns));
+		return;
+	}
+
+	if (rec->worker >= 0)
+		printf("T%d ", rec->worker);
+
+	printf("R%ld:" NSTIME_FMT "," NSTIME_FMT "," NSTIME_FMT ","
+	       NSTIME_FMT "," NSTIME_FMT "\n", rec->req_id,
+	       NSTIME_ARGS(rec->sent_ns), NSTIME_ARGS(rec->length_ns),
+	       NSTIME_ARGS(rec->receipt_ns), NSTIME_ARGS(rec->start_ns),
+	       NSTIME_ARGS(rec->completion_ns));
+
+	if (print_queue)
+		printf("Q:%u\n", rec->queue_len);
+}
+
+/* Account for one record in the summary statistics */
+void update_stats(struct trace_stats * stats, struct trace_record * rec)
+{
+	int64_t response;
+
+	if (stats->completed + stats->rejected == 0 || rec->receipt_ns < stats->first_ns)
+		stats->first_ns = rec->receipt_ns;
+	if (rec->completion_ns > stats->last_ns)
+		stats->last_ns = rec->completion_ns;
+
+	if (rec->ack == RESP_REJECTED) {
+		stats->rejected++;
+		return;
+	}
+
+	response = rec->completion_ns - rec->receipt_ns;
+
+	stats->completed++;
+	stats->busy_ns += rec->completion_ns - rec->start_ns;
+	stats->response_ns += response;
+	stats->wait_ns += rec->start_ns - rec->receipt_ns;
+	stats->queue_len += rec->queue_len;
+	if (rec->worker + 1 > stats->workers)
+		stats->workers = rec->worker + 1;
+	if (response > stats->max_response_ns)
+		stats->max_response_ns = response;
+}
+
+/* Print the summary statistics of the trace */
+void print_stats(struct trace_stats * stats)
+{
+	uint64_t total = stats->completed + stats->rejected;
+	double span = NSEC_TO_DOUBLE(stats->last_ns - stats->first_ns);
+	double n = (stats->completed > 0 ? stats->completed : 1);
+	int workers = (stats->workers > 0 ? stats->workers : 1);
+
+	printf("Requests: %lu\n", total);
+	printf("Completed: %lu\n", stats->completed);
+	printf("Rejected: %lu (%.2lf%%)\n", stats->rejected,
+	       (total > 0 ? 100.0 * stats->rejected / total : 0));
+	printf("Duration: %lf\n", span);
+	printf("Throughput: %lf\n", (span > 0 ? stats->completed / span : 0));
+	printf("Workers: %d\n", workers);
+	printf("Utilization: %.2lf%%\n",
+	       (span > 0 ? 100 * NSEC_TO_DOUBLE(stats->busy_ns) / span / workers : 0));
+	printf("Avg. response time: %lf\n", NSEC_TO_DOUBLE(stats->response_ns / n));
+	printf("Max. response time: %lf\n", NSEC_TO_DOUBLE(stats->max_response_ns));
+	printf("Avg. waiting time: %lf\n", NSEC_TO_DOUBLE(stats->wait_ns / n));
+	printf("Avg. queue length: %lf\n", stats->queue_len / n);
+}
+
+int main (int argc, char ** argv) {
+	struct trace_record rec;
+	struct trace_stats stats;
+	int opt, summary = 0, print_queue = 0;
+	FILE * in;
+
+	while ((opt = getopt(argc, argv, "sq")) != -1) {
+		switch (opt) {
+		case 's':
+			summary = 1;
+			break;
+		case 'q':
+			print_queue = 1;
+			break;
+		default:
+			fprintf(stderr, USAGE_STRING, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		ERROR_INFO();
+		fprintf(stderr, USAGE_STRING, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(argv[optind], "-") == 0) {
+		in = stdin;
+	} else {
+		in = fopen(argv[optind], "rb");
+		if (in == NULL) {
+			ERROR_INFO();
+			perror("Unable to open trace file");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (trace_read_header(in) < 0) {
+		ERROR_INFO();
+		fprintf(stderr, "Not a trace file, or unsupported version: %s\n",
+			argv[optind]);
+		if (in != stdin)
+			fclose(in);
+		return EXIT_FAILURE;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+
+	while (trace_read(in, &rec) == 0) {
+		if (summary)
+			update_stats(&stats, &rec);
+		else
+			print_record(&rec, print_queue);
+	}
+
+	if (summary)
+		print_stats(&stats);
+
+	if (in != stdin)
+		fclose(in);
+
+	return EXIT_SUCCESS;
+}